@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <time.h>
 
+#include "portability/instr_time.h"
 
 #ifdef HAVE_POLL_H
 #include <poll.h>
@@ -52,6 +53,34 @@ const char *PROGRAM_VERSION = "unknown";
  */
 #define SWITCH_THRESHOLD_DEFAULT	100
 
+/*
+ * APPLY_TARGET_MS: With --max-swap-apply-ms, the rounds of the catch-up are
+ * sized to take about that many milliseconds, applying between
+ * APPLY_COUNT_MIN and APPLY_COUNT_MAX changes each.
+ */
+#define APPLY_TARGET_MS		1000
+#define APPLY_COUNT_MIN		100
+#define APPLY_COUNT_MAX		1000000
+
+/*
+ * CATCHUP_SAMPLE_SECS: How often the size of the log is sampled during the
+ * catch-up, to estimate when it will be applied. The estimate is reported
+ * every CATCHUP_REPORT_SECS, and with --catchup-horizon the repack is given
+ * up once it has been observed for CATCHUP_TREND_SECS. Before the repack of
+ * a table, its write rate is measured over CATCHUP_PREFLIGHT_SECS.
+ */
+#define CATCHUP_SAMPLE_SECS		1
+#define CATCHUP_REPORT_SECS		10
+#define CATCHUP_TREND_SECS		10
+#define CATCHUP_PREFLIGHT_SECS	5
+
+/*
+ * COPY_PARALLEL_MIN_BLOCKS: Tables smaller than this many blocks per worker
+ * are copied by the main connection alone. Under pg_regress, whose tables
+ * are small, a single block per worker is enough.
+ */
+#define COPY_PARALLEL_MIN_BLOCKS	1024
+
 /* poll() or select() timeout, in seconds */
 #define POLL_TIMEOUT    3
 
@@ -177,6 +206,16 @@ typedef struct repack_index
 	int             worker_idx;		/* which worker conn is handling */
 } repack_index;
 
+/*
+ * per-worker information for applying the log in parallel
+ */
+typedef struct apply_job
+{
+	const char	   *params[2];		/* parameters of the apply query */
+	char			relid[12];
+	char			count[12];
+} apply_job;
+
 /*
  * per-table information
  */
@@ -189,13 +228,13 @@ typedef struct repack_table
 	Oid				pkid;			/* target: PK OID */
 	Oid				ckid;			/* target: CK OID */
 	Oid				temp_oid;		/* temp: OID */
-	const char	   *create_pktype;	/* CREATE TYPE pk */
 	const char	   *create_log;		/* CREATE TABLE log */
-	const char	   *create_trigger;	/* CREATE TRIGGER repack_trigger */
-	const char	   *enable_trigger;	/* ALTER TABLE ENABLE ALWAYS TRIGGER repack_trigger */
+	const char	   *create_trigger;	/* CREATE TRIGGER repack_trigger(s) */
+	const char	   *enable_trigger;	/* ALTER TABLE ENABLE ALWAYS TRIGGER repack_trigger(s) */
 	const char	   *create_table;	/* CREATE TABLE table AS SELECT WITH NO DATA*/
 	const char	   *dest_tablespace; /* Destination tablespace */
 	const char	   *copy_data;		/* INSERT INTO */
+	bool			copy_ordered;	/* copy_data has an ORDER BY */
 	const char	   *alter_col_storage;	/* ALTER TABLE ALTER COLUMN SET STORAGE */
 	const char	   *drop_columns;	/* ALTER TABLE DROP COLUMNs */
 	const char	   *delete_log;		/* DELETE FROM log */
@@ -203,8 +242,12 @@ typedef struct repack_table
 	const char	   *sql_peek;		/* SQL used in flush */
 	const char	   *sql_insert;		/* SQL used in flush */
 	const char	   *sql_delete;		/* SQL used in flush */
-	const char	   *sql_update;		/* SQL used in flush */
 	const char	   *sql_pop;		/* SQL used in flush */
+	bool			capture_logical;	/* capture changes by logical decoding */
+	const char	   *sql_peek_ring;	/* SQL used in flush to drain the shared memory ring */
+	bool			key_only_log;	/* log keys only, rows are read back on apply */
+	const char	   *log_part_key;	/* keys of the log for repack.key_part(), to apply it in parallel */
+	const char	   *unlogged_since;	/* server start time, if the log is unlogged */
 	int             n_indexes;      /* number of indexes */
 	repack_index   *indexes;        /* info on each index */
 } repack_table;
@@ -223,6 +266,7 @@ static void repack_cleanup(bool fatal, const repack_table *table);
 static void repack_cleanup_callback(bool fatal, void *userdata);
 static void repack_cleanup_index(bool fatal, void *userdata);
 static bool rebuild_indexes(const repack_table *table);
+static bool rebuild_indexes_applying(const repack_table *table);
 
 static char *getstr(PGresult *res, int row, int col);
 static Oid getoid(PGresult *res, int row, int col);
@@ -264,6 +308,14 @@ static bool 			error_on_invalid_index = false; /* don't repack when invalid inde
 								 * deprecated, this the default behavior now */
 static int				apply_count = APPLY_COUNT_DEFAULT;
 static int				switch_threshold = SWITCH_THRESHOLD_DEFAULT;
+static int				max_swap_apply_ms = 0;	/* 0: switch at switch_threshold */
+static int				catchup_horizon = 0;	/* 0: never give up the catch-up */
+static double			apply_rate_seen = 0;	/* of the last table, see apply_control */
+static bool				apply_during_build = false;	/* apply the log while the indexes are built */
+static int				apply_fillfactor = 0;	/* fillfactor of the new table, 0: the original one */
+static char				*capture = NULL;	/* change capture method */
+static bool				key_only_log = false;	/* log keys only */
+static bool				unlogged_log = false;	/* create the log tables UNLOGGED */
 
 /* buffer should have at least 11 bytes */
 static char *
@@ -298,6 +350,13 @@ static pgut_option options[] =
 	{ 'b', 3, "error-on-invalid-index", &error_on_invalid_index },
 	{ 'i', 2, "apply-count", &apply_count },
 	{ 'i', 1, "switch-threshold", &switch_threshold },
+	{ 's', 6, "capture", &capture },
+	{ 'b', 7, "key-only-log", &key_only_log },
+	{ 'b', 8, "unlogged-log", &unlogged_log },
+	{ 'i', 9, "max-swap-apply-ms", &max_swap_apply_ms },
+	{ 'i', 10, "catchup-horizon", &catchup_horizon },
+	{ 'b', 11, "apply-during-build", &apply_during_build },
+	{ 'i', 12, "apply-fillfactor", &apply_fillfactor },
 	{ 0 },
 };
 
@@ -320,6 +379,35 @@ main(int argc, char *argv[])
 		ereport(ERROR, (errcode(EINVAL),
 			errmsg("switch_threshold must be less than apply_count")));
 
+	if (max_swap_apply_ms < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("max-swap-apply-ms must be positive")));
+
+	if (catchup_horizon < 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("catchup-horizon must be positive")));
+
+	if (apply_during_build && jobs < 2)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("--apply-during-build requires --jobs of 2 or more")));
+
+	if (apply_fillfactor != 0 && (apply_fillfactor < 10 || apply_fillfactor > 100))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("apply-fillfactor must be between 10 and 100")));
+
+	if (capture && strcmp(capture, "row") != 0 &&
+		strcmp(capture, "statement") != 0 &&
+		strcmp(capture, "logical") != 0 &&
+		strcmp(capture, "ring") != 0)
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("invalid value for --capture: \"%s\", expected \"row\", \"statement\", \"logical\" or \"ring\"",
+				   capture)));
+
+	if (key_only_log && capture &&
+		(strcmp(capture, "logical") == 0 || strcmp(capture, "ring") == 0))
+		ereport(ERROR, (errcode(EINVAL),
+			errmsg("cannot use --key-only-log with --capture=%s", capture)));
+
 	check_tablespace();
 
 	if (dryrun)
@@ -826,6 +914,11 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 	if (!is_requested_relation_exists(errbuf, errsize))
 		goto cleanup;
 
+	/* The updates are only replayed as updates, and can be HOT, from 14 */
+	if (apply_fillfactor && PQserverVersion(connection) < 140000)
+		ereport(WARNING, (errcode(EINVAL),
+			errmsg("option --apply-fillfactor requires PostgreSQL 14 or later, it has no effect")));
+
 	/* acquire target tables */
 	appendStringInfoString(&sql,
 		"SELECT t.*,"
@@ -943,6 +1036,11 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 		repack_table	table;
 		StringInfoData	copy_sql;
 		const char *ckey;
+		const char *create_statement_trigger;
+		const char *enable_statement_trigger;
+		const char *logical_capture;
+		const char *create_key_log;
+		const char *sql_peek_keys;
 		int			c = 0;
 
 		table.target_name = getstr(res, i, c++);
@@ -961,7 +1059,6 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 			continue;
 		}
 
-		table.create_pktype = getstr(res, i, c++);
 		table.create_log = getstr(res, i, c++);
 		table.create_trigger = getstr(res, i, c++);
 		table.enable_trigger = getstr(res, i, c++);
@@ -975,15 +1072,67 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 		table.lock_table = getstr(res, i, c++);
 		ckey = getstr(res, i, c++);
 		table.sql_peek = getstr(res, i, c++);
+		c += 3;		/* sql_insert, sql_delete, sql_update are for repack_apply */
+		table.sql_pop = getstr(res, i, c++);
+		create_statement_trigger = getstr(res, i, c++);
+		enable_statement_trigger = getstr(res, i, c++);
+		logical_capture = getstr(res, i, c++);
+		create_key_log = getstr(res, i, c++);
+		sql_peek_keys = getstr(res, i, c++);
 		table.sql_insert = getstr(res, i, c++);
 		table.sql_delete = getstr(res, i, c++);
-		table.sql_update = getstr(res, i, c++);
-		table.sql_pop = getstr(res, i, c++);
+		table.log_part_key = getstr(res, i, c++);
 		table.dest_tablespace = getstr(res, i, c++);
+		table.capture_logical = false;
+		table.sql_peek_ring = NULL;	/* set when the ring is registered */
+		table.key_only_log = false;
+		table.unlogged_since = NULL;	/* set when the log is created */
+
+		/* Use statement level triggers if requested and possible */
+		if (capture && strcmp(capture, "statement") == 0)
+		{
+			if (create_statement_trigger)
+			{
+				table.create_trigger = create_statement_trigger;
+				table.enable_trigger = enable_statement_trigger;
+			}
+			else
+				elog(INFO, "statement level capture is not available for table \"%s\", using row level triggers",
+					 table.target_name);
+		}
+
+		/* Decode the changes from the WAL if requested and possible */
+		if (capture && strcmp(capture, "logical") == 0)
+		{
+			if (logical_capture && strcmp(logical_capture, "t") == 0)
+				table.capture_logical = true;
+			else
+				elog(INFO, "logical capture is not available for table \"%s\", using row level triggers",
+					 table.target_name);
+		}
+
+		/*
+		 * Log only the keys if requested and possible: the rows are read
+		 * back from the table when the log is applied, and the updates are
+		 * applied as a delete followed by an insert.
+		 */
+		if (key_only_log)
+		{
+			if (create_key_log)
+			{
+				table.create_log = create_key_log;
+				table.sql_peek = sql_peek_keys;
+				table.key_only_log = true;
+			}
+			else
+				elog(INFO, "key-only log is not available for table \"%s\" because it has other unique indexes, logging full rows",
+					 table.target_name);
+		}
 
 		/* Craft Copy SQL */
 		initStringInfo(&copy_sql);
 		appendStringInfoString(&copy_sql, table.copy_data);
+		table.copy_ordered = false;
 		if (!orderby)
 
 		{
@@ -992,6 +1141,7 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 				/* CLUSTER mode */
 				appendStringInfoString(&copy_sql, " ORDER BY ");
 				appendStringInfoString(&copy_sql, ckey);
+				table.copy_ordered = true;
 			}
 
 			/* else, VACUUM FULL mode (non-clustered tables) */
@@ -1005,6 +1155,7 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 			/* User specified ORDER BY */
 			appendStringInfoString(&copy_sql, " ORDER BY ");
 			appendStringInfoString(&copy_sql, orderby);
+			table.copy_ordered = true;
 		}
 		table.copy_data = copy_sql.data;
 
@@ -1020,243 +1171,1156 @@ cleanup:
 	return ret;
 }
 
+/*
+ * The query applying the changes of the ring, taking (relid, pkid, sql_peek,
+ * sql_pop, count) as parameters: the first two are set in params, using
+ * relid and pkid as buffers.
+ */
+static const char *
+apply_log_query(PGconn *conn, const repack_table *table, const char **params,
+				char *relid, char *pkid)
+{
+	/*
+	 * From PostgreSQL 14, the changes are applied by the executor directly,
+	 * otherwise by set-based statements.
+	 */
+	if (PQserverVersion(conn) >= 140000)
+	{
+		params[0] = utoa(table->target_oid, relid);
+		params[1] = utoa(table->pkid, pkid);
+		return "SELECT repack.repack_apply_direct($1, $2, $3, $4, $5)";
+	}
+
+	/* same parameters, the statements taking the place of the OIDs */
+	params[0] = table->sql_insert;
+	params[1] = table->sql_delete;
+	return "SELECT repack.repack_apply_batch($3, $1, $2, $4, $5)";
+}
+
+/*
+ * Whether the log of the table can be applied by the workers, each one
+ * applying the changes of a partition of the keys: only when it is in the
+ * log table with full rows, so that the changes of a key are all in its
+ * partition and do not depend on the other keys.
+ */
+static bool
+apply_log_parallel_ok(const repack_table *table)
+{
+	return workers.num_workers > 1 && table->log_part_key != NULL &&
+		!table->capture_logical && !table->key_only_log &&
+		table->sql_peek_ring == NULL;
+}
+
+/*
+ * Register on conn the statements applying the log of the table, peeking the
+ * changes with sql_peek: repack.apply_registered() then keeps their plans in
+ * the backend instead of preparing them again on each call.
+ */
+static void
+register_apply(PGconn *conn, const repack_table *table, const char *sql_peek)
+{
+	const char *params[6];
+	char		relid[12];
+	char		pkid[12];
+
+	params[0] = utoa(table->target_oid, relid);
+	params[1] = utoa(table->pkid, pkid);
+	params[2] = sql_peek;
+	params[3] = table->sql_insert;
+	params[4] = table->sql_delete;
+	params[5] = table->sql_pop;
+	pgut_command(conn, "SELECT repack.apply_register($1, $2, $3, $4, $5, $6)",
+				 6, params);
+}
+
+/*
+ * The peek of the changes of the log applied by worker i, the ones of its
+ * partition of the keys. Its predicate and order match the index created on
+ * the log with the log table.
+ */
+static char *
+apply_log_parallel_peek(const repack_table *table, int i)
+{
+	StringInfoData	sql;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "SELECT * FROM repack.log_%u"
+					 " WHERE repack.key_part(%d, %s) = %d"
+					 " ORDER BY id LIMIT $1",
+					 table->target_oid, workers.num_workers,
+					 table->log_part_key, i);
+	return sql.data;
+}
+
 static int
 apply_log(PGconn *conn, const repack_table *table, int count)
 {
-	int			result;
+	int			result = 0;
+	int			applied;
 	PGresult   *res;
-	const char *params[6];
+	const char *params[5];
 	char		buffer[12];
+	char		relid[12];
+	char		pkid[12];
+
+	/*
+	 * The changes in the shared memory ring are older than the ones which
+	 * overflowed into the log table, apply them first. ring_peek consumes
+	 * the changes, there is nothing to pop.
+	 */
+	if (table->sql_peek_ring)
+	{
+		const char *sql_apply;
+
+		sql_apply = apply_log_query(conn, table, params, relid, pkid);
+		params[2] = table->sql_peek_ring;
+		params[3] = NULL;
+		params[4] = utoa(count, buffer);
+
+		res = pgut_execute(conn, sql_apply, 5, params);
+		result = atoi(PQgetvalue(res, 0, 0));
+		CLEARPGRES(res);
+
+		if (count > 0 && result >= count)
+			return result;
+	}
+
+	/* the statements of the log were registered by register_apply */
+	params[0] = utoa(table->target_oid, relid);
+	params[1] = utoa(count > 0 ? count - result : count, buffer);
 
-	params[0] = table->sql_peek;
-	params[1] = table->sql_insert;
-	params[2] = table->sql_delete;
-	params[3] = table->sql_update;
-	params[4] = table->sql_pop;
-	params[5] = utoa(count, buffer);
-
-	res = pgut_execute(conn,
-					   "SELECT repack.repack_apply($1, $2, $3, $4, $5, $6)",
-					   6, params);
-	result = atoi(PQgetvalue(res, 0, 0));
+	res = pgut_execute(conn, "SELECT repack.apply_registered($1, $2)", 2, params);
+	applied = atoi(PQgetvalue(res, 0, 0));
+	result += applied;
 	CLEARPGRES(res);
 
+	/*
+	 * Truncate the segments of the log which were entirely applied, so that
+	 * the next peeks do not have to skip their dead rows. Not needed for the
+	 * last round, or when the changes are not in the log at all.
+	 */
+	if (count > 0 && applied > 0 && !table->capture_logical)
+		pgut_command(conn, "SELECT repack.truncate_log_segments($1)", 1, params);
+
 	return result;
 }
 
 /*
- * Create indexes on temp table, possibly using multiple worker connections
- * concurrently if the user asked for --jobs=...
+ * Wait for the queries sent to the first n workers to finish, their results
+ * being left to read. On interrupt, cancel them, as the cancel requests of
+ * pgut are not sent to the workers, and return false.
  */
 static bool
-rebuild_indexes(const repack_table *table)
+wait_workers(int n)
 {
-	PGresult	   *res = NULL;
-	int			    num_indexes;
-	int				i;
-	int				num_active_workers;
-	int				num_workers;
-	repack_index   *index_jobs;
-	bool            have_error = false;
-
-	elog(DEBUG2, "---- create indexes ----");
-
-	num_indexes = table->n_indexes;
-
-	/* We might have more actual worker connections than we need,
-	 * if the number of workers exceeds the number of indexes to be
-	 * built. In that case, ignore the extra workers.
-	 */
-	num_workers = num_indexes > workers.num_workers ? workers.num_workers : num_indexes;
-	num_active_workers = num_workers;
-
-	elog(DEBUG2, "Have %d indexes and num_workers=%d", num_indexes,
-		 num_workers);
+	PGconn	  **busy;
+	bool		canceled = false;
+	int			i;
 
-	index_jobs = table->indexes;
+	if (n == 0)
+		return true;
 
-	for (i = 0; i < num_indexes; i++)
+	busy = pgut_malloc(sizeof(PGconn *) * n);
+	for (;;)
 	{
+		struct timeval	timeout;
+		int				nbusy = 0;
 
-		elog(DEBUG2, "set up index_jobs [%d]", i);
-		elog(DEBUG2, "target_oid   : %u", index_jobs[i].target_oid);
-		elog(DEBUG2, "create_index : %s", index_jobs[i].create_index);
-
-		if (num_workers <= 1) {
-			/* Use primary connection if we are not setting up parallel
-			 * index building, or if we only have one worker.
-			 */
-			command(index_jobs[i].create_index, 0, NULL);
+		/* a broken connection is not busy, PQgetResult reports its error */
+		for (i = 0; i < n; i++)
+		{
+			PGconn	   *conn = workers.conns[i];
 
-			/* This bookkeeping isn't actually important in this no-workers
-			 * case, but just for clarity.
-			 */
-			index_jobs[i].status = FINISHED;
+			if (PQconsumeInput(conn) == 1 && PQisBusy(conn))
+				busy[nbusy++] = conn;
 		}
-		else if (i < num_workers) {
-			/* Assign available worker to build an index. */
-			index_jobs[i].status = INPROGRESS;
-			index_jobs[i].worker_idx = i;
-			elog(INFO, "Initial worker %d to build index: %s",
-				 i, index_jobs[i].create_index);
+		if (nbusy == 0 || canceled)
+			break;
 
-			if (!(PQsendQuery(workers.conns[i], index_jobs[i].create_index)))
+		if (interrupted)
+		{
+			for (i = 0; i < nbusy; i++)
 			{
-				elog(WARNING, "Error sending async query: %s\n%s",
-					 index_jobs[i].create_index,
-					 PQerrorMessage(workers.conns[i]));
-				have_error = true;
-				goto cleanup;
+				PGcancel   *cancel = PQgetCancel(busy[i]);
+				char		errbuf[256];
+
+				if (cancel)
+				{
+					PQcancel(cancel, errbuf, sizeof(errbuf));
+					PQfreeCancel(cancel);
+				}
 			}
+			canceled = true;
+			continue;
 		}
-		/* Else we have more indexes to be built than workers
-		 * available. That's OK, we'll get to them later.
-		 */
+
+		timeout.tv_sec = POLL_TIMEOUT;
+		timeout.tv_usec = 0;
+		pgut_wait(nbusy, busy, &timeout);
 	}
+	free(busy);
 
-	if (num_workers > 1)
+	return !canceled;
+}
+
+/*
+ * Same as apply_log, the changes being applied concurrently by the workers,
+ * each one up to count changes of its partition of the keys, registered with
+ * apply_log_parallel_peek.  The changes of a key are applied in order by a
+ * single worker, and each worker pops the ids it applied, so the workers need
+ * no other coordination.  *drained is set if every worker applied fewer than
+ * count changes, having emptied its partition.
+ */
+static int
+apply_log_parallel(const repack_table *table, int count, bool *drained)
+{
+	int				result = 0;
+	int				nworkers = workers.num_workers;
+	int				sent = 0;		/* workers applying, the first ones */
+	bool			failed = false;
+	apply_job	   *apply_jobs;
+	int				i;
+
+	apply_jobs = pgut_malloc(sizeof(apply_job) * nworkers);
+	*drained = true;
+
+	for (i = 0; i < nworkers; i++)
 	{
-		int freed_worker = -1;
-		int ret;
+		PGconn	   *conn = workers.conns[i];
 
-/* Prefer poll() over select(), following PostgreSQL custom. */
-#ifdef HAVE_POLL
-		struct pollfd *input_fds;
+		apply_jobs[i].params[0] = utoa(table->target_oid, apply_jobs[i].relid);
+		apply_jobs[i].params[1] = utoa(count, apply_jobs[i].count);
 
-		input_fds = pgut_malloc(sizeof(struct pollfd) * num_workers);
-		for (i = 0; i < num_workers; i++)
+		if (!PQsendQueryParams(conn, "SELECT repack.apply_registered($1, $2)",
+							   2, NULL, apply_jobs[i].params, NULL, NULL, 0))
 		{
-			input_fds[i].fd = PQsocket(workers.conns[i]);
-			input_fds[i].events = POLLIN | POLLERR;
-			input_fds[i].revents = 0;
+			elog(WARNING, "Error sending apply to worker %d: %s", i,
+				 PQerrorMessage(conn));
+			failed = true;
+			break;
 		}
-#else
-		fd_set input_mask;
-		struct timeval timeout;
-		/* select() needs the highest-numbered socket descriptor */
-		int max_fd;
-#endif
+		sent++;
+	}
 
-		/* Now go through our index builds, and look for any which is
-		 * reported complete. Reassign that worker to the next index to
-		 * be built, if any.
-		 */
-		while (num_active_workers > 0)
-		{
-			elog(DEBUG2, "polling %d active workers", num_active_workers);
+	/* wait for the workers started before reporting an error */
+	if (!wait_workers(sent))
+		failed = true;
+	for (i = 0; i < sent; i++)
+	{
+		PGresult   *res;
 
-#ifdef HAVE_POLL
-			ret = poll(input_fds, num_workers, POLL_TIMEOUT * 1000);
-#else
-			/* re-initialize timeout and input_mask before each
-			 * invocation of select(). I think this isn't
-			 * necessary on many Unixen, but just in case.
-			 */
-			timeout.tv_sec = POLL_TIMEOUT;
-			timeout.tv_usec = 0;
+		while ((res = PQgetResult(workers.conns[i])))
+		{
+			if (PQresultStatus(res) == PGRES_TUPLES_OK)
+			{
+				int		applied = atoi(PQgetvalue(res, 0, 0));
 
-			FD_ZERO(&input_mask);
-			for (i = 0, max_fd = 0; i < num_workers; i++)
+				result += applied;
+				if (count > 0 && applied >= count)
+					*drained = false;
+			}
+			else
 			{
-				FD_SET(PQsocket(workers.conns[i]), &input_mask);
-				if (PQsocket(workers.conns[i]) > max_fd)
-					max_fd = PQsocket(workers.conns[i]);
+				elog(WARNING, "Error applying the log on worker %d: %s", i,
+					 PQerrorMessage(workers.conns[i]));
+				failed = true;
 			}
+			CLEARPGRES(res);
+		}
+	}
+	free(apply_jobs);
 
-			ret = select(max_fd + 1, &input_mask, NULL, NULL, &timeout);
-#endif
-			/* XXX: the errno != EINTR check means we won't bail
-			 * out on SIGINT. We should probably just remove this
-			 * check, though it seems we also need to fix up
-			 * the on_interrupt handling for workers' index
-			 * builds (those PGconns don't seem to have c->cancel
-			 * set, so we don't cancel the in-progress builds).
-			 */
-			if (ret < 0 && errno != EINTR)
-				elog(ERROR, "poll() failed: %d, %d", ret, errno);
+	if (failed)
+		elog(ERROR, "could not apply the log of table \"%s\"",
+			 table->target_name);
 
-			elog(DEBUG2, "Poll returned: %d", ret);
+	/* see apply_log */
+	if (result > 0)
+	{
+		char		buffer[12];
+		const char *relid = utoa(table->target_oid, buffer);
 
-			for (i = 0; i < num_indexes; i++)
-			{
-				if (index_jobs[i].status == INPROGRESS)
-				{
-					Assert(index_jobs[i].worker_idx >= 0);
-					/* Must call PQconsumeInput before we can check PQisBusy */
-					if (PQconsumeInput(workers.conns[index_jobs[i].worker_idx]) != 1)
-					{
-						elog(WARNING, "Error fetching async query status: %s",
-							 PQerrorMessage(workers.conns[index_jobs[i].worker_idx]));
-						have_error = true;
-						goto cleanup;
-					}
-					if (!PQisBusy(workers.conns[index_jobs[i].worker_idx]))
-					{
-						elog(INFO, "Command finished in worker %d: %s",
-							 index_jobs[i].worker_idx,
-							 index_jobs[i].create_index);
+		pgut_command(connection, "SELECT repack.truncate_log_segments($1)",
+					 1, &relid);
+	}
 
-						while ((res = PQgetResult(workers.conns[index_jobs[i].worker_idx])))
-						{
-							if (PQresultStatus(res) != PGRES_COMMAND_OK)
-							{
-								elog(WARNING, "Error with create index: %s",
-									 PQerrorMessage(workers.conns[index_jobs[i].worker_idx]));
-								have_error = true;
+	return result;
+}
+
+/*
+ * The catch-up controller, used with --max-swap-apply-ms. It measures how
+ * fast each connection applies the changes and how fast they are logged,
+ * sizes the next rounds to take about APPLY_TARGET_MS, and predicts how long
+ * the final apply under the exclusive lock would take if the tables were
+ * switched now: the changes logged while a round runs are left for the next
+ * one, so they are about the log rate times the duration of the round.
+ * Without --max-swap-apply-ms, the rounds apply apply_count changes and the
+ * tables are switched once a round applied switch_threshold or fewer.
+ */
+typedef struct apply_control
+{
+	int			count;			/* changes to apply per connection next round */
+	double		apply_rate;		/* changes applied per ms by a connection */
+	double		log_rate;		/* changes logged per ms */
+	double		swap_ms;		/* predicted final apply, -1 if unknown */
+	bool		drained;		/* the last round emptied the log */
+	bool		started;		/* last_start is set */
+	instr_time	last_start;		/* start of the last round */
+} apply_control;
+
+static void
+apply_control_init(apply_control *control)
+{
+	memset(control, 0, sizeof(apply_control));
+	control->count = apply_count;
+	control->swap_ms = -1;
+}
+
+/* half the old rate and half the new one, or the new one if first */
+static double
+apply_control_smooth(double rate, double sample)
+{
+	return rate > 0 ? (rate + sample) / 2 : sample;
+}
+
+/*
+ * account for a round which applied num changes on nconns connections,
+ * drained if it left none of the changes logged before it started
+ */
+static void
+apply_control_update(apply_control *control, int num, int nconns,
+					 bool drained, instr_time start, instr_time end)
+{
+	instr_time	elapsed = end;
+	double		ms;
+
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	ms = INSTR_TIME_GET_MILLISEC(elapsed);
+
+	control->drained = drained;
+
+	if (num > 0 && ms > 0)
+		control->apply_rate = apply_control_smooth(control->apply_rate,
+												   num / ms / nconns);
+
+	/* a round which emptied the log applied what was logged since the last */
+	if (control->drained && control->started)
+	{
+		instr_time	interval = start;
+		double		interval_ms;
+
+		INSTR_TIME_SUBTRACT(interval, control->last_start);
+		interval_ms = INSTR_TIME_GET_MILLISEC(interval);
+		if (interval_ms > 0)
+			control->log_rate = apply_control_smooth(control->log_rate,
+													 num / interval_ms);
+	}
+	control->last_start = start;
+	control->started = true;
+
+	if (max_swap_apply_ms <= 0 || control->apply_rate <= 0)
+		return;
+
+	/* the workers each apply up to count changes, see apply_log_parallel */
+	control->count = (int) Min(control->apply_rate * APPLY_TARGET_MS,
+							   APPLY_COUNT_MAX);
+	control->count = Max(control->count, APPLY_COUNT_MIN);
+	control->swap_ms = Max(num, control->log_rate * ms) / control->apply_rate;
+
+	elog(DEBUG2, "applied %d changes in %.0f ms, %.1f applied and %.1f logged per ms, next round %d, switch in %.0f ms",
+		 num, ms, control->apply_rate * nconns, control->log_rate,
+		 control->count, control->swap_ms);
+}
+
+/* true if the tables can be switched after a round which applied num */
+static bool
+apply_control_switch(const apply_control *control, int num)
+{
+	if (max_swap_apply_ms <= 0 || control->swap_ms < 0)
+		return num <= switch_threshold;
+
+	return control->drained && control->swap_ms <= max_swap_apply_ms;
+}
+
+/*
+ * The size of the log during the catch-up, sampled every CATCHUP_SAMPLE_SECS
+ * to follow how fast it shrinks, and predict when it will be applied.
+ */
+typedef struct catchup_trend
+{
+	int			nsamples;		/* samples taken */
+	instr_time	start;			/* first sample */
+	instr_time	last;			/* last sample */
+	instr_time	last_report;	/* last report of the estimate */
+	double		backlog;		/* changes in the log at the last sample */
+	double		slope;			/* smoothed change of the backlog per second */
+} catchup_trend;
+
+/* seconds from a to b */
+static double
+elapsed_secs(instr_time a, instr_time b)
+{
+	INSTR_TIME_SUBTRACT(b, a);
+	return INSTR_TIME_GET_MILLISEC(b) / 1000.0;
+}
+
+/*
+ * Sample the backlog of the log of table if CATCHUP_SAMPLE_SECS passed since
+ * the last sample: the rows left in the log table and its segments, plus the
+ * changes left in the shared memory ring with --capture=ring. The rows are
+ * not counted, which would scan the whole log every time, nor taken from the
+ * range of their ids, which are shared by all the log tables and skip those
+ * of rolled back changes: they are the live rows of the statistics, which
+ * follow the inserts, deletes and truncates of the log within a second or so.
+ */
+static void
+catchup_trend_update(catchup_trend *trend, const repack_table *table)
+{
+	PGresult   *res;
+	instr_time	now;
+	double		backlog;
+	char		sql[512];
+	const char *params[1];
+
+	INSTR_TIME_SET_CURRENT(now);
+	if (trend->nsamples > 0 &&
+		elapsed_secs(trend->last, now) < CATCHUP_SAMPLE_SECS)
+		return;
+
+	snprintf(sql, sizeof(sql),
+			 "SELECT coalesce(sum(n_live_tup), 0)"
+			 " + CASE WHEN $1 THEN repack.ring_pending(%u) ELSE 0 END"
+			 " FROM pg_catalog.pg_stat_user_tables"
+			 " WHERE relid = 'repack.log_%u'::regclass"
+			 " OR relid IN (SELECT inhrelid FROM pg_catalog.pg_inherits"
+			 " WHERE inhparent = 'repack.log_%u'::regclass)",
+			 table->target_oid, table->target_oid, table->target_oid);
+	params[0] = table->sql_peek_ring ? "t" : "f";
+	res = pgut_execute(connection, sql, 1, params);
+	backlog = atof(PQgetvalue(res, 0, 0));
+	CLEARPGRES(res);
+
+	if (trend->nsamples == 0)
+	{
+		trend->start = now;
+		trend->last_report = now;
+	}
+	else
+	{
+		double	slope = (backlog - trend->backlog) / elapsed_secs(trend->last, now);
+
+		/* half the old slope and half the new one */
+		trend->slope = (trend->nsamples > 1 ? (trend->slope + slope) / 2 : slope);
+	}
+	trend->last = now;
+	trend->backlog = backlog;
+	trend->nsamples++;
+}
+
+/* seconds to apply the log at the current trend, or -1 if it does not shrink */
+static double
+catchup_trend_eta(const catchup_trend *trend)
+{
+	if (trend->slope >= 0)
+		return trend->backlog > 0 ? -1 : 0;
+	return trend->backlog / -trend->slope;
+}
+
+/*
+ * Report the estimate every CATCHUP_REPORT_SECS unless quiet, and return
+ * false if the catch-up should be given up: with --catchup-horizon, when the
+ * log is not expected to be applied within that many seconds after being
+ * watched for CATCHUP_TREND_SECS.
+ */
+static bool
+catchup_trend_check(catchup_trend *trend, const repack_table *table, bool quiet)
+{
+	double		eta = catchup_trend_eta(trend);
+
+	if (trend->nsamples < 2)
+		return true;
+
+	if (!quiet &&
+		elapsed_secs(trend->last_report, trend->last) >= CATCHUP_REPORT_SECS)
+	{
+		if (eta < 0)
+			elog(NOTICE, "%.0f changes left to apply, the log is not shrinking",
+				 trend->backlog);
+		else
+			elog(NOTICE, "%.0f changes left to apply, about %.0f seconds to go",
+				 trend->backlog, eta);
+		trend->last_report = trend->last;
+	}
+
+	if (catchup_horizon <= 0 ||
+		elapsed_secs(trend->start, trend->last) < CATCHUP_TREND_SECS)
+		return true;
+
+	if (eta < 0 || eta > catchup_horizon)
+	{
+		elog(WARNING, "giving up table \"%s\": its log is not expected to be applied within %d seconds",
+			 table->target_name, catchup_horizon);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Rows written to table according to the statistics, or -1 if unknown. The
+ * snapshot of the statistics is cleared first, so that two calls in the same
+ * transaction see the writes in between.
+ */
+static double
+table_writes(const repack_table *table)
+{
+	PGresult   *res;
+	const char *params[1];
+	char		buffer[12];
+	double		writes = -1;
+
+	pgut_command(connection, "SELECT pg_stat_clear_snapshot()", 0, NULL);
+	params[0] = utoa(table->target_oid, buffer);
+	res = pgut_execute(connection,
+		"SELECT n_tup_ins + n_tup_upd + n_tup_del"
+		" FROM pg_stat_user_tables WHERE relid = $1",
+		1, params);
+	if (PQntuples(res) > 0 && !PQgetisnull(res, 0, 0))
+		writes = atof(PQgetvalue(res, 0, 0));
+	CLEARPGRES(res);
+
+	return writes;
+}
+
+/*
+ * Before setting up the repack of table with --catchup-horizon, skip it if
+ * its current write rate, measured over CATCHUP_PREFLIGHT_SECS, exceeds what
+ * the apply of the table repacked before could sustain: its log would never
+ * be applied. Nothing is known for the first table.
+ */
+static bool
+catchup_preflight(const repack_table *table)
+{
+	double		writes;
+	double		write_rate;
+	double		apply_rate;
+	instr_time	start;
+	instr_time	end;
+	int			i;
+
+	if (catchup_horizon <= 0 || apply_rate_seen <= 0)
+		return true;
+
+	INSTR_TIME_SET_CURRENT(start);
+	writes = table_writes(table);
+	if (writes < 0)
+		return true;
+	for (i = 0; i < CATCHUP_PREFLIGHT_SECS; i++)
+	{
+		sleep(1);
+		CHECK_FOR_INTERRUPTS();
+	}
+	write_rate = table_writes(table);
+	INSTR_TIME_SET_CURRENT(end);
+	if (write_rate < 0)
+		return true;
+	write_rate = (write_rate - writes) / elapsed_secs(start, end);
+
+	apply_rate = apply_rate_seen * 1000 *
+		(apply_log_parallel_ok(table) ? workers.num_workers : 1);
+	elog(DEBUG2, "%.1f changes written and %.1f applied per second",
+		 write_rate, apply_rate);
+
+	if (write_rate >= apply_rate)
+	{
+		elog(WARNING, "skipping table \"%s\": it is written faster than its log could be applied",
+			 table->target_name);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Create indexes on temp table, possibly using multiple worker connections
+ * concurrently if the user asked for --jobs=...
+ */
+static bool
+rebuild_indexes(const repack_table *table)
+{
+	PGresult	   *res = NULL;
+	int			    num_indexes;
+	int				i;
+	int				num_active_workers;
+	int				num_workers;
+	repack_index   *index_jobs;
+	bool            have_error = false;
+
+	elog(DEBUG2, "---- create indexes ----");
+
+	num_indexes = table->n_indexes;
+
+	/* We might have more actual worker connections than we need,
+	 * if the number of workers exceeds the number of indexes to be
+	 * built. In that case, ignore the extra workers.
+	 */
+	num_workers = num_indexes > workers.num_workers ? workers.num_workers : num_indexes;
+	num_active_workers = num_workers;
+
+	elog(DEBUG2, "Have %d indexes and num_workers=%d", num_indexes,
+		 num_workers);
+
+	index_jobs = table->indexes;
+
+	for (i = 0; i < num_indexes; i++)
+	{
+
+		elog(DEBUG2, "set up index_jobs [%d]", i);
+		elog(DEBUG2, "target_oid   : %u", index_jobs[i].target_oid);
+		elog(DEBUG2, "create_index : %s", index_jobs[i].create_index);
+
+		if (num_workers <= 1) {
+			/* Use primary connection if we are not setting up parallel
+			 * index building, or if we only have one worker.
+			 */
+			command(index_jobs[i].create_index, 0, NULL);
+
+			/* This bookkeeping isn't actually important in this no-workers
+			 * case, but just for clarity.
+			 */
+			index_jobs[i].status = FINISHED;
+		}
+		else if (i < num_workers) {
+			/* Assign available worker to build an index. */
+			index_jobs[i].status = INPROGRESS;
+			index_jobs[i].worker_idx = i;
+			elog(INFO, "Initial worker %d to build index: %s",
+				 i, index_jobs[i].create_index);
+
+			if (!(PQsendQuery(workers.conns[i], index_jobs[i].create_index)))
+			{
+				elog(WARNING, "Error sending async query: %s\n%s",
+					 index_jobs[i].create_index,
+					 PQerrorMessage(workers.conns[i]));
+				have_error = true;
+				goto cleanup;
+			}
+		}
+		/* Else we have more indexes to be built than workers
+		 * available. That's OK, we'll get to them later.
+		 */
+	}
+
+	if (num_workers > 1)
+	{
+		int freed_worker = -1;
+		int ret;
+
+/* Prefer poll() over select(), following PostgreSQL custom. */
+#ifdef HAVE_POLL
+		struct pollfd *input_fds;
+
+		input_fds = pgut_malloc(sizeof(struct pollfd) * num_workers);
+		for (i = 0; i < num_workers; i++)
+		{
+			input_fds[i].fd = PQsocket(workers.conns[i]);
+			input_fds[i].events = POLLIN | POLLERR;
+			input_fds[i].revents = 0;
+		}
+#else
+		fd_set input_mask;
+		struct timeval timeout;
+		/* select() needs the highest-numbered socket descriptor */
+		int max_fd;
+#endif
+
+		/* Now go through our index builds, and look for any which is
+		 * reported complete. Reassign that worker to the next index to
+		 * be built, if any.
+		 */
+		while (num_active_workers > 0)
+		{
+			elog(DEBUG2, "polling %d active workers", num_active_workers);
+
+#ifdef HAVE_POLL
+			ret = poll(input_fds, num_workers, POLL_TIMEOUT * 1000);
+#else
+			/* re-initialize timeout and input_mask before each
+			 * invocation of select(). I think this isn't
+			 * necessary on many Unixen, but just in case.
+			 */
+			timeout.tv_sec = POLL_TIMEOUT;
+			timeout.tv_usec = 0;
+
+			FD_ZERO(&input_mask);
+			for (i = 0, max_fd = 0; i < num_workers; i++)
+			{
+				FD_SET(PQsocket(workers.conns[i]), &input_mask);
+				if (PQsocket(workers.conns[i]) > max_fd)
+					max_fd = PQsocket(workers.conns[i]);
+			}
+
+			ret = select(max_fd + 1, &input_mask, NULL, NULL, &timeout);
+#endif
+			/* XXX: the errno != EINTR check means we won't bail
+			 * out on SIGINT. We should probably just remove this
+			 * check, though it seems we also need to fix up
+			 * the on_interrupt handling for workers' index
+			 * builds (those PGconns don't seem to have c->cancel
+			 * set, so we don't cancel the in-progress builds).
+			 */
+			if (ret < 0 && errno != EINTR)
+				elog(ERROR, "poll() failed: %d, %d", ret, errno);
+
+			elog(DEBUG2, "Poll returned: %d", ret);
+
+			for (i = 0; i < num_indexes; i++)
+			{
+				if (index_jobs[i].status == INPROGRESS)
+				{
+					Assert(index_jobs[i].worker_idx >= 0);
+					/* Must call PQconsumeInput before we can check PQisBusy */
+					if (PQconsumeInput(workers.conns[index_jobs[i].worker_idx]) != 1)
+					{
+						elog(WARNING, "Error fetching async query status: %s",
+							 PQerrorMessage(workers.conns[index_jobs[i].worker_idx]));
+						have_error = true;
+						goto cleanup;
+					}
+					if (!PQisBusy(workers.conns[index_jobs[i].worker_idx]))
+					{
+						elog(INFO, "Command finished in worker %d: %s",
+							 index_jobs[i].worker_idx,
+							 index_jobs[i].create_index);
+
+						while ((res = PQgetResult(workers.conns[index_jobs[i].worker_idx])))
+						{
+							if (PQresultStatus(res) != PGRES_COMMAND_OK)
+							{
+								elog(WARNING, "Error with create index: %s",
+									 PQerrorMessage(workers.conns[index_jobs[i].worker_idx]));
+								have_error = true;
 								goto cleanup;
 							}
 							CLEARPGRES(res);
 						}
 
-						/* We are only going to re-queue one worker, even
-						 * though more than one index build might be finished.
-						 * Any other jobs which may be finished will
-						 * just have to wait for the next pass through the
-						 * poll()/select() loop.
-						 */
-						freed_worker = index_jobs[i].worker_idx;
-						index_jobs[i].status = FINISHED;
-						num_active_workers--;
-						break;
-					}
-				}
+						/* We are only going to re-queue one worker, even
+						 * though more than one index build might be finished.
+						 * Any other jobs which may be finished will
+						 * just have to wait for the next pass through the
+						 * poll()/select() loop.
+						 */
+						freed_worker = index_jobs[i].worker_idx;
+						index_jobs[i].status = FINISHED;
+						num_active_workers--;
+						break;
+					}
+				}
+			}
+			if (freed_worker > -1)
+			{
+				for (i = 0; i < num_indexes; i++)
+				{
+					if (index_jobs[i].status == UNPROCESSED)
+					{
+						index_jobs[i].status = INPROGRESS;
+						index_jobs[i].worker_idx = freed_worker;
+						elog(INFO, "Assigning worker %d to build index #%d: "
+							 "%s", freed_worker, i,
+							 index_jobs[i].create_index);
+
+						if (!(PQsendQuery(workers.conns[freed_worker],
+										  index_jobs[i].create_index))) {
+							elog(WARNING, "Error sending async query: %s\n%s",
+								 index_jobs[i].create_index,
+								 PQerrorMessage(workers.conns[freed_worker]));
+							have_error = true;
+							goto cleanup;
+						}
+						num_active_workers++;
+						break;
+					}
+				}
+				freed_worker = -1;
+			}
+		}
+
+	}
+
+cleanup:
+	CLEARPGRES(res);
+	return (!have_error);
+}
+
+
+/*
+ * Create the new table of table on the main connection, empty. Before copying
+ * data to the target table, we need to set the column storage type if its
+ * storage type has been changed from the type default.
+ */
+static void
+create_new_table(const repack_table *table)
+{
+	const char	   *params[2];
+	char			buffer[12];
+	StringInfoData	sql;
+
+	params[0] = utoa(table->target_oid, buffer);
+	params[1] = table->dest_tablespace;
+	command(table->create_table, 2, params);
+	if (table->alter_col_storage)
+		command(table->alter_col_storage, 0, NULL);
+
+	/*
+	 * Leave room in the pages of the copy for the replayed updates to be
+	 * HOT, which needs the executor applying them directly, unless the
+	 * table already leaves more. The reloption stays on the new table, whose
+	 * pg_class entry is dropped after the swap: the pages are left as they
+	 * are filled, the fillfactor of the table is not changed.
+	 */
+	if (apply_fillfactor && PQserverVersion(connection) >= 140000)
+	{
+		PGresult   *res;
+		int			fillfactor;
+
+		res = execute("SELECT coalesce((SELECT option_value::integer"
+					  " FROM pg_catalog.pg_options_to_table(reloptions)"
+					  " WHERE option_name = 'fillfactor'), 100)"
+					  " FROM pg_catalog.pg_class WHERE oid = $1", 1, params);
+		fillfactor = Min(apply_fillfactor, atoi(PQgetvalue(res, 0, 0)));
+		CLEARPGRES(res);
+
+		initStringInfo(&sql);
+		appendStringInfo(&sql, "ALTER TABLE repack.table_%u SET (fillfactor = %d)",
+						 table->target_oid, fillfactor);
+		command(sql.data, 0, NULL);
+		termStringInfo(&sql);
+	}
+}
+
+/*
+ * Create the new table of table filled with its rows, with a single CREATE
+ * TABLE AS rather than create_new_table and copy_data: unlike INSERT, it can
+ * scan the table with parallel workers, which serializable transactions may
+ * use from PostgreSQL 12. The storage of the columns must be set before the
+ * rows are written, and the fillfactor of --apply-fillfactor, which only
+ * has an effect from PostgreSQL 14, would clash with the original storage
+ * parameters, so the copy is left to copy_data in these cases. Returns false
+ * if the table was not created.
+ */
+static bool
+copy_data_as(const repack_table *table)
+{
+	const char	   *params[3];
+	char			buffer[12];
+	StringInfoData	sql;
+	size_t			len;
+
+	if (PQserverVersion(connection) < 120000 || table->alter_col_storage ||
+		(apply_fillfactor && PQserverVersion(connection) >= 140000))
+		return false;
+
+	/* the query of copy_data, without its INSERT INTO repack.table_<oid> */
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "INSERT INTO repack.table_%u ", table->target_oid);
+	len = sql.len;
+	if (strncmp(table->copy_data, sql.data, len) != 0)
+	{
+		termStringInfo(&sql);
+		return false;
+	}
+	termStringInfo(&sql);
+
+	/* give the scan the workers of maintenance commands, if more */
+	command("SELECT set_config('max_parallel_workers_per_gather',"
+			" greatest(current_setting('max_parallel_workers_per_gather')::integer,"
+			" current_setting('max_parallel_maintenance_workers')::integer)::text,"
+			" true)",
+			0, NULL);
+
+	params[0] = utoa(table->target_oid, buffer);
+	params[1] = table->dest_tablespace;
+	params[2] = table->copy_data + len;
+	command("SELECT repack.create_table_as($1, $2, $3)", 3, params);
+	return true;
+}
+
+/*
+ * Whether we are run by pg_regress: appname will be "pg_repack" in normal
+ * use on 9.0+, or "pg_regress/<testname>" when run under `make installcheck`
+ * ("pg_regress" on PostgreSQL <10).
+ */
+static bool
+under_regress(void)
+{
+	const char *appname = getenv("PGAPPNAME");
+
+	return appname &&
+		(strncmp(appname, "pg_regress/", strlen("pg_regress/")) == 0 ||
+		 strcmp(appname, "pg_regress") == 0);
+}
+
+/*
+ * The number of blocks of table to copy on the workers, or 0 if the copy is
+ * to be done by the main connection: the rows are copied by block ranges,
+ * which needs TID range scans, from PostgreSQL 14, and cannot keep the order
+ * of an ordered copy.
+ */
+static int
+copy_parallel_blocks(const repack_table *table)
+{
+	PGresult   *res;
+	const char *params[1];
+	char		buffer[12];
+	int			nblocks;
+	int			min_blocks;
+
+	if (workers.num_workers < 2 || table->copy_ordered ||
+		PQserverVersion(connection) < 140000)
+		return 0;
+
+	params[0] = utoa(table->target_oid, buffer);
+	res = execute("SELECT pg_catalog.pg_relation_size($1::oid)"
+				  " / current_setting('block_size')::bigint", 1, params);
+	nblocks = atoi(PQgetvalue(res, 0, 0));
+	CLEARPGRES(res);
+
+	min_blocks = under_regress() ? 1 : COPY_PARALLEL_MIN_BLOCKS;
+	return nblocks >= min_blocks * workers.num_workers ? nblocks : 0;
+}
+
+/*
+ * Copy the rows of table into the new table on the workers, each one a range
+ * of its nblocks blocks, the last range going to the end of the table. The
+ * workers import the snapshot of the copy transaction of the main
+ * connection, exported as snapshot, so they copy the same rows as copy_data
+ * would, and commit once all of them are done.
+ */
+static bool
+copy_data_parallel(const repack_table *table, const char *snapshot, int nblocks)
+{
+	int				nworkers = workers.num_workers;
+	int				begun = 0;		/* workers in a transaction */
+	int				sent = 0;		/* workers copying, the first ones */
+	bool			have_error = false;
+	StringInfoData	sql;
+	int				i;
+
+	initStringInfo(&sql);
+
+	for (i = 0; i < nworkers && !have_error; i++)
+	{
+		PGconn	   *conn = workers.conns[i];
+
+		pgut_command(conn, "BEGIN ISOLATION LEVEL REPEATABLE READ", 0, NULL);
+		begun++;
+		printfStringInfo(&sql, "SET TRANSACTION SNAPSHOT '%s'", snapshot);
+		pgut_command(conn, sql.data, 0, NULL);
+		/* same as the copy on the main connection */
+		pgut_command(conn, "SELECT set_config('work_mem', current_setting('maintenance_work_mem'), true)", 0, NULL);
+
+		/* see the lock taken for the copy in repack_one_table */
+		if (!(lock_access_share(conn, table->target_oid, table->target_name)))
+		{
+			have_error = true;
+			break;
+		}
+
+		printfStringInfo(&sql, "%s WHERE ctid >= '(%u,0)'", table->copy_data,
+						 (unsigned int) ((int64) nblocks * i / nworkers));
+		if (i < nworkers - 1)
+			appendStringInfo(&sql, " AND ctid < '(%u,0)'",
+							 (unsigned int) ((int64) nblocks * (i + 1) / nworkers));
+		elog(DEBUG2, "worker %d copying: %s", i, sql.data);
+
+		if (!PQsendQuery(conn, sql.data))
+		{
+			elog(WARNING, "Error sending async query: %s\n%s",
+				 sql.data, PQerrorMessage(conn));
+			have_error = true;
+			break;
+		}
+		sent++;
+	}
+
+	/* wait for the workers started before reporting an error */
+	if (!wait_workers(sent))
+		have_error = true;
+
+	/* the copies are done, or canceled and about to be */
+	for (i = 0; i < sent; i++)
+	{
+		PGconn	   *conn = workers.conns[i];
+		PGresult   *res;
+
+		while ((res = PQgetResult(conn)))
+		{
+			if (PQresultStatus(res) != PGRES_COMMAND_OK)
+			{
+				elog(WARNING, "Error copying the rows on worker %d: %s", i,
+					 PQerrorMessage(conn));
+				have_error = true;
 			}
-			if (freed_worker > -1)
+			CLEARPGRES(res);
+		}
+	}
+
+	for (i = 0; i < begun; i++)
+	{
+		if (have_error)
+			pgut_rollback(workers.conns[i]);
+		else
+			pgut_command(workers.conns[i], "COMMIT", 0, NULL);
+	}
+
+	termStringInfo(&sql);
+	return !have_error;
+}
+
+/*
+ * Apply up to count changes of the log on the main connection, outside of
+ * the catch-up loop. Applying a key-only log reads the original table, so
+ * the lock is taken the same way as for the copy. Returns -1 if it could not
+ * be taken.
+ */
+static int
+apply_log_locked(const repack_table *table, int count)
+{
+	int			num;
+
+	if (table->key_only_log)
+	{
+		command("BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+		if (!(lock_access_share(connection, table->target_oid, table->target_name)))
+			return -1;
+	}
+	num = apply_log(connection, table, count);
+	if (table->key_only_log)
+		command("COMMIT", 0, NULL);
+
+	return num;
+}
+
+/*
+ * Same as rebuild_indexes, applying the log on the main connection while the
+ * indexes are built, for --apply-during-build. A CREATE INDEX locks out the
+ * changes of the apply, so only the index used as the key of the log, which
+ * the apply needs, is built that way. The other ones are built afterwards by
+ * the first worker with CREATE INDEX CONCURRENTLY, which lets the apply go
+ * on, but cannot run twice at the same time on a table: they are built one
+ * at a time.
+ */
+static bool
+rebuild_indexes_applying(const repack_table *table)
+{
+	PGconn		   *conn = workers.conns[0];
+	PGresult	   *res;
+	repack_index   *index_jobs = table->indexes;
+	bool			have_error = false;
+	bool			have_key = false;
+	int				i;
+
+	for (i = 0; i < table->n_indexes; i++)
+		have_key |= (index_jobs[i].target_oid == table->pkid);
+	if (!have_key)
+		return rebuild_indexes(table);
+
+	elog(DEBUG2, "---- create indexes, applying the log ----");
+
+	for (i = 0; i < table->n_indexes; i++)
+	{
+		if (index_jobs[i].target_oid == table->pkid)
+		{
+			command(index_jobs[i].create_index, 0, NULL);
+			index_jobs[i].status = FINISHED;
+		}
+	}
+	register_apply(connection, table, table->sql_peek);
+
+	for (i = 0; i < table->n_indexes && !have_error; i++)
+	{
+		const char	   *def = index_jobs[i].create_index;
+		const char	   *name = strstr(def, " index_");
+		StringInfoData	sql;
+
+		if (index_jobs[i].status == FINISHED)
+			continue;
+
+		/* CREATE [UNIQUE] INDEX CONCURRENTLY index_<oid> ON ... */
+		Assert(name != NULL);
+		initStringInfo(&sql);
+		appendBinaryStringInfo(&sql, def, name - def);
+		appendStringInfo(&sql, " CONCURRENTLY%s", name);
+
+		elog(INFO, "Worker 0 building index while the log is applied: %s",
+			 sql.data);
+		index_jobs[i].status = INPROGRESS;
+		index_jobs[i].worker_idx = 0;
+		if (!PQsendQuery(conn, sql.data))
+		{
+			elog(WARNING, "Error sending async query: %s\n%s",
+				 sql.data, PQerrorMessage(conn));
+			termStringInfo(&sql);
+			have_error = true;
+			break;
+		}
+		termStringInfo(&sql);
+
+		for (;;)
+		{
+			struct timeval	timeout;
+			int				num;
+
+			if (PQconsumeInput(conn) != 1)
 			{
-				for (i = 0; i < num_indexes; i++)
-				{
-					if (index_jobs[i].status == UNPROCESSED)
-					{
-						index_jobs[i].status = INPROGRESS;
-						index_jobs[i].worker_idx = freed_worker;
-						elog(INFO, "Assigning worker %d to build index #%d: "
-							 "%s", freed_worker, i,
-							 index_jobs[i].create_index);
+				elog(WARNING, "Error fetching async query status: %s",
+					 PQerrorMessage(conn));
+				have_error = true;
+				break;
+			}
+			if (!PQisBusy(conn))
+				break;
 
-						if (!(PQsendQuery(workers.conns[freed_worker],
-										  index_jobs[i].create_index))) {
-							elog(WARNING, "Error sending async query: %s\n%s",
-								 index_jobs[i].create_index,
-								 PQerrorMessage(workers.conns[freed_worker]));
-							have_error = true;
-							goto cleanup;
-						}
-						num_active_workers++;
-						break;
-					}
+			/* once failed, only wait for the build to be canceled */
+			num = have_error ? 0 : apply_log_locked(table, apply_count);
+			if (num < 0)
+			{
+				PGcancel   *cancel = PQgetCancel(conn);
+				char		errbuf[256];
+
+				/* stop the build, it would hold off the cleanup */
+				if (cancel)
+				{
+					PQcancel(cancel, errbuf, sizeof(errbuf));
+					PQfreeCancel(cancel);
 				}
-				freed_worker = -1;
+				have_error = true;
+			}
+			else if (num < apply_count)
+			{
+				/* the log is applied, wait for the build for a while */
+				timeout.tv_sec = POLL_TIMEOUT;
+				timeout.tv_usec = 0;
+				pgut_wait(1, &conn, &timeout);
 			}
 		}
 
+		while ((res = PQgetResult(conn)))
+		{
+			if (PQresultStatus(res) != PGRES_COMMAND_OK && !have_error)
+			{
+				elog(WARNING, "Error with create index: %s",
+					 PQerrorMessage(conn));
+				have_error = true;
+			}
+			CLEARPGRES(res);
+		}
+		index_jobs[i].status = FINISHED;
 	}
 
-cleanup:
-	CLEARPGRES(res);
-	return (!have_error);
+	return !have_error;
 }
 
-
 /*
  * Re-organize one table.
  */
@@ -1267,6 +2331,7 @@ repack_one_table(repack_table *table, const char *orderby)
 	const char	   *params[3];
 	int				num;
 	char		   *vxid = NULL;
+	char		   *slot_name = NULL;
 	char			buffer[12];
 	StringInfoData	sql;
 	bool            ret = false;
@@ -1274,12 +2339,13 @@ repack_one_table(repack_table *table, const char *orderby)
 	const char     *indexparams[2];
 	char		    indexbuffer[12];
 	int             j;
+	int				copy_blocks;
+	apply_control	control;
+	instr_time		start;
+	instr_time		end;
+	catchup_trend	trend;
 
-	/* appname will be "pg_repack" in normal use on 9.0+, or
-	 * "pg_regress/<testname>" when run under `make installcheck`
-	 * ("pg_regress" on PostgreSQL <10).
-	 */
-	const char     *appname = getenv("PGAPPNAME");
+	bool			regress = under_regress();
 
 	/* Keep track of whether we have gotten through setup to install
 	 * the repack_trigger, log table, etc. ourselves. We don't want to
@@ -1300,7 +2366,6 @@ repack_one_table(repack_table *table, const char *orderby)
 	elog(DEBUG2, "target_tidx       : %u", table->target_tidx);
 	elog(DEBUG2, "pkid              : %u", table->pkid);
 	elog(DEBUG2, "ckid              : %u", table->ckid);
-	elog(DEBUG2, "create_pktype     : %s", table->create_pktype);
 	elog(DEBUG2, "create_log        : %s", table->create_log);
 	elog(DEBUG2, "create_trigger    : %s", table->create_trigger);
 	elog(DEBUG2, "enable_trigger    : %s", table->enable_trigger);
@@ -1315,12 +2380,18 @@ repack_one_table(repack_table *table, const char *orderby)
 	elog(DEBUG2, "sql_peek          : %s", table->sql_peek);
 	elog(DEBUG2, "sql_insert        : %s", table->sql_insert);
 	elog(DEBUG2, "sql_delete        : %s", table->sql_delete);
-	elog(DEBUG2, "sql_update        : %s", table->sql_update);
 	elog(DEBUG2, "sql_pop           : %s", table->sql_pop);
+	elog(DEBUG2, "capture_logical   : %s", table->capture_logical ? "true" : "false");
+	elog(DEBUG2, "capture_ring      : %s", capture && strcmp(capture, "ring") == 0 ? "true" : "false");
+	elog(DEBUG2, "key_only_log      : %s", table->key_only_log ? "true" : "false");
+	elog(DEBUG2, "log_part_key      : %s", table->log_part_key ? table->log_part_key : "(none)");
 
 	if (dryrun)
 		return;
 
+	if (!catchup_preflight(table))
+		return;
+
 	/* push repack_cleanup_callback() on stack to clean temporary objects */
 	pgut_atexit_push(repack_cleanup_callback, table);
 
@@ -1398,7 +2469,7 @@ repack_one_table(repack_table *table, const char *orderby)
 
 
 	/*
-	 * Check if repack_trigger is not conflict with existing trigger. We can
+	 * Check if repack triggers do not conflict with existing triggers. We can
 	 * find it out later but we check it in advance and go to cleanup if needed.
 	 * In AFTER trigger context, since triggered tuple is not changed by other
 	 * trigger we don't care about the fire order.
@@ -1409,7 +2480,7 @@ repack_one_table(repack_table *table, const char *orderby)
 		ereport(WARNING,
 				(errcode(E_PG_COMMAND),
 				 errmsg("the table \"%s\" already has a trigger called \"%s\"",
-						table->target_name, "repack_trigger"),
+						table->target_name, getstr(res, 0, 0)),
 				 errdetail(
 					 "The trigger was probably installed during a previous"
 					 " attempt to run pg_repack on the table which was"
@@ -1422,13 +2493,71 @@ repack_one_table(repack_table *table, const char *orderby)
 
 	CLEARPGRES(res);
 
-	command(table->create_pktype, 0, NULL);
-	temp_obj_num++;
 	command(table->create_log, 0, NULL);
 	temp_obj_num++;
-	command(table->create_trigger, 0, NULL);
+
+	/*
+	 * With --unlogged-log, the changes are not written to the WAL twice, but
+	 * the log is emptied if the server crashes. Remember when the server
+	 * started, to refuse the swap if it restarted in the meantime.
+	 */
+	if (unlogged_log)
+	{
+		printfStringInfo(&sql,
+						 "SELECT repack.alter_log_table(%u, 'SET UNLOGGED')",
+						 table->target_oid);
+		command(sql.data, 0, NULL);
+		res = execute("SELECT pg_postmaster_start_time()", 0, NULL);
+		table->unlogged_since = pgut_strdup(getstr(res, 0, 0));
+		CLEARPGRES(res);
+	}
+
+	/*
+	 * With --capture=ring, have repack_trigger write the changes to shared
+	 * memory instead of the log table. The ring is registered before the
+	 * trigger is committed, so no change goes anywhere else; the log table
+	 * still receives the changes if the ring overflows. repack_drop()
+	 * unregisters it.
+	 */
+	if (capture && strcmp(capture, "ring") == 0)
+	{
+		printfStringInfo(&sql, "SELECT repack.ring_register(%u)",
+						 table->target_oid);
+		res = execute(sql.data, 0, NULL);
+		if (strcmp(getstr(res, 0, 0), "t") == 0)
+		{
+			printfStringInfo(&sql,
+				"SELECT * FROM repack.ring_peek(%u, $1, NULL::repack.log_%u)",
+				table->target_oid, table->target_oid);
+			table->sql_peek_ring = pgut_strdup(sql.data);
+		}
+		else
+			elog(INFO, "shared memory capture is not available for table \"%s\", using the log table",
+				 table->target_name);
+		CLEARPGRES(res);
+	}
+
+	/*
+	 * With parallel apply, each worker peeks the changes of its partition of
+	 * the keys in id order, see apply_log_parallel_peek. Index the log on the
+	 * partitions while it is still empty, so that the workers read their
+	 * changes only instead of each scanning the whole log.
+	 */
+	if (apply_log_parallel_ok(table))
+	{
+		printfStringInfo(&sql,
+						 "CREATE INDEX ON repack.log_%u (repack.key_part(%d, %s), id)",
+						 table->target_oid, workers.num_workers,
+						 table->log_part_key);
+		command(sql.data, 0, NULL);
+	}
+
+	/* No trigger is needed when the changes are decoded from the WAL */
+	if (!table->capture_logical)
+		command(table->create_trigger, 0, NULL);
 	temp_obj_num++;
-	command(table->enable_trigger, 0, NULL);
+	if (!table->capture_logical)
+		command(table->enable_trigger, 0, NULL);
 	printfStringInfo(&sql, "SELECT repack.disable_autovacuum('repack.log_%u')", table->target_oid);
 	command(sql.data, 0, NULL);
 
@@ -1519,11 +2648,46 @@ repack_one_table(repack_table *table, const char *orderby)
 		goto cleanup;
 	}
 
+	/*
+	 * With logical capture, create the replication slot now that conn2
+	 * prevents DDL on the table: every transaction committing after the
+	 * slot is consistent will be decoded. The slot is temporary and belongs
+	 * to the main connection, which is the one applying the changes.
+	 * repack_drop() drops it.
+	 */
+	if (table->capture_logical)
+	{
+		printfStringInfo(&sql,
+			"SELECT slot_name FROM pg_create_logical_replication_slot("
+			"'repack_%u_' || pg_backend_pid(), 'pg_repack', true)",
+			table->target_oid);
+		res = execute(sql.data, 0, NULL);
+		slot_name = pgut_strdup(PQgetvalue(res, 0, 0));
+		CLEARPGRES(res);
+	}
+
 	/*
 	 * 2. Copy tuples into temp table.
 	 */
 	elog(DEBUG2, "---- copy tuples ----");
 
+	/*
+	 * The workers cannot see a table created by the copy transaction, so
+	 * for a parallel copy create it beforehand; it is empty until then.
+	 */
+	copy_blocks = copy_parallel_blocks(table);
+	if (copy_blocks > 0)
+	{
+		elog(DEBUG2, "copying %d blocks on %d workers", copy_blocks,
+			 workers.num_workers);
+		command("BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+		if (!(lock_access_share(connection, table->target_oid, table->target_name)))
+			goto cleanup;
+		create_new_table(table);
+		command("COMMIT", 0, NULL);
+		temp_obj_num++;
+	}
+
 	/* Must use SERIALIZABLE (or at least not READ COMMITTED) to avoid race
 	 * condition between the create_table statement and rows subsequently
 	 * being added to the log.
@@ -1549,6 +2713,32 @@ repack_one_table(repack_table *table, const char *orderby)
 	 * log we could wind up with duplicates.
 	 */
 	command(table->delete_log, 0, NULL);
+	if (table->sql_peek_ring)
+	{
+		printfStringInfo(&sql, "SELECT repack.ring_discard(%u)",
+						 table->target_oid);
+		command(sql.data, 0, NULL);
+	}
+
+	/*
+	 * With logical capture the changes committed between the creation of the
+	 * slot and our snapshot are both decoded and copied: pass the snapshot to
+	 * the output plugin so it skips them, like delete_log does for the log.
+	 */
+	if (table->capture_logical)
+	{
+		res = execute("SELECT txid_current_snapshot()", 0, NULL);
+		printfStringInfo(&sql,
+			"SELECT (l).* FROM"
+			" (SELECT data::repack.log_%u AS l"
+			"    FROM pg_logical_slot_get_changes('%s', NULL, $1,"
+			"         'relid', '%u', 'pkid', '%u', 'snapshot', '%s') OFFSET 0) s",
+			table->target_oid, slot_name, table->target_oid, table->pkid,
+			PQgetvalue(res, 0, 0));
+		table->sql_peek = pgut_strdup(sql.data);
+		table->sql_pop = NULL;
+		CLEARPGRES(res);
+	}
 
 	/* We need to be able to obtain an AccessShare lock on the target table
 	 * for the create_table command to go through, so go ahead and obtain
@@ -1565,17 +2755,26 @@ repack_one_table(repack_table *table, const char *orderby)
 	if (!(lock_access_share(connection, table->target_oid, table->target_name)))
 		goto cleanup;
 
-	/*
-	 * Before copying data to the target table, we need to set the column storage
-	 * type if its storage type has been changed from the type default.
-	 */
-	params[0] = utoa(table->target_oid, buffer);
-	params[1] = table->dest_tablespace;
-	command(table->create_table, 2, params);
-	if (table->alter_col_storage)
-		command(table->alter_col_storage, 0, NULL);
-	command(table->copy_data, 0, NULL);
-	temp_obj_num++;
+	if (copy_blocks > 0)
+	{
+		/* the workers copy the rows with the snapshot of this transaction */
+		bool	copied;
+
+		res = execute("SELECT pg_export_snapshot()", 0, NULL);
+		copied = copy_data_parallel(table, PQgetvalue(res, 0, 0), copy_blocks);
+		CLEARPGRES(res);
+		if (!copied)
+			goto cleanup;
+	}
+	else
+	{
+		if (!copy_data_as(table))
+		{
+			create_new_table(table);
+			command(table->copy_data, 0, NULL);
+		}
+		temp_obj_num++;
+	}
 	printfStringInfo(&sql, "SELECT repack.disable_autovacuum('repack.table_%u')", table->target_oid);
 	if (table->drop_columns)
 		command(table->drop_columns, 0, NULL);
@@ -1591,9 +2790,15 @@ repack_one_table(repack_table *table, const char *orderby)
 	CLEARPGRES(res);
 
 	/*
-	 * 3. Create indexes on temp table.
+	 * 3. Create indexes on temp table, applying the log meanwhile if asked
+	 * to, and if there is a worker to build them.
 	 */
-	if (!rebuild_indexes(table))
+	if (apply_during_build && workers.num_workers > 0 && table->n_indexes > 1)
+	{
+		if (!rebuild_indexes_applying(table))
+			goto cleanup;
+	}
+	else if (!rebuild_indexes(table))
 		goto cleanup;
 
 	/* don't clear indexres until after rebuild_indexes or bad things happen */
@@ -1604,9 +2809,52 @@ repack_one_table(repack_table *table, const char *orderby)
 	 * 4. Apply log to temp table until no tuples are left in the log
 	 * and all of the old transactions are finished.
 	 */
+	register_apply(connection, table, table->sql_peek);
+	if (apply_log_parallel_ok(table))
+	{
+		for (j = 0; j < workers.num_workers; j++)
+		{
+			char   *sql_peek = apply_log_parallel_peek(table, j);
+
+			register_apply(workers.conns[j], table, sql_peek);
+			free(sql_peek);
+		}
+	}
+
+	apply_control_init(&control);
+	memset(&trend, 0, sizeof(trend));
 	for (;;)
 	{
-		num = apply_log(connection, table, apply_count);
+		INSTR_TIME_SET_CURRENT(start);
+
+		/*
+		 * Applying a key-only log reads the original table, take the lock
+		 * the same way as for the copy.
+		 */
+		if (table->key_only_log)
+		{
+			command("BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+			if (!(lock_access_share(connection, table->target_oid, table->target_name)))
+				goto cleanup;
+		}
+		if (apply_log_parallel_ok(table))
+		{
+			bool	drained;
+
+			num = apply_log_parallel(table, control.count, &drained);
+			INSTR_TIME_SET_CURRENT(end);
+			apply_control_update(&control, num, workers.num_workers, drained,
+								 start, end);
+		}
+		else
+		{
+			num = apply_log(connection, table, control.count);
+			INSTR_TIME_SET_CURRENT(end);
+			apply_control_update(&control, num, 1, num < control.count,
+								 start, end);
+		}
+		if (table->key_only_log)
+			command("COMMIT", 0, NULL);
 
 		/* We'll keep applying tuples from the log table in batches
 		 * of apply_count, until applying a batch of tuples
@@ -1615,9 +2863,25 @@ repack_one_table(repack_table *table, const char *orderby)
 		 * get stuck repetitively applying some small number of tuples
 		 * from the log table as inserts/updates/deletes may be
 		 * constantly coming into the original table.
+		 * With --max-swap-apply-ms, the batches are sized and the
+		 * switch decided by apply_control instead.
 		 */
-		if (num > switch_threshold)
-			continue;	/* there might be still some tuples, repeat. */
+		if (!apply_control_switch(&control, num))
+		{
+			/*
+			 * There might be still some tuples, repeat, unless the log
+			 * is not shrinking fast enough for --catchup-horizon. The
+			 * changes decoded from the WAL are not in the log until they
+			 * are applied.
+			 */
+			if (catchup_horizon > 0 && !table->capture_logical)
+			{
+				catchup_trend_update(&trend, table);
+				if (!catchup_trend_check(&trend, table, regress))
+					goto cleanup;
+			}
+			continue;
+		}
 
 		/* old transactions still alive ? */
 		params[0] = vxid;
@@ -1632,9 +2896,7 @@ repack_one_table(repack_table *table, const char *orderby)
 			 * noise which would trip up pg_regress.
 			 */
 
-			if (!appname ||
-				(strncmp(appname, "pg_regress/", strlen("pg_regress/")) != 0 &&
-				 strcmp(appname, "pg_regress") != 0))
+			if (!regress)
 			{
 				elog(NOTICE, "Waiting for %d transactions to finish. First PID: %s", num, PQgetvalue(res, 0, 0));
 			}
@@ -1648,6 +2910,8 @@ repack_one_table(repack_table *table, const char *orderby)
 			/* All old transactions are finished;
 			 * go to next step. */
 			CLEARPGRES(res);
+			if (control.apply_rate > 0)
+				apply_rate_seen = control.apply_rate;
 			break;
 		}
 	}
@@ -1667,6 +2931,18 @@ repack_one_table(repack_table *table, const char *orderby)
 		goto cleanup;
 	}
 
+	/*
+	 * The replication slot belongs to the main connection, so apply the
+	 * last changes there, before conn2 locks the temp table. Nobody can
+	 * write to the table anymore, but the commit records of transactions
+	 * committed asynchronously might not have been flushed yet.
+	 */
+	if (table->capture_logical)
+	{
+		command("SELECT repack.flush_wal()", 0, NULL);
+		apply_log(connection, table, 0);
+	}
+
 	/*
 	 * Acquire AccessExclusiveLock on the temp table to prevent concurrent
 	 * operations during swapping relations.
@@ -1681,7 +2957,37 @@ repack_one_table(repack_table *table, const char *orderby)
 		goto cleanup;
 	}
 
-	apply_log(conn2, table, 0);
+	/*
+	 * An unlogged log is truncated by crash recovery: if the server restarted
+	 * since it was created (through a pooler, our connections could have
+	 * survived), changes may be missing, so leave the table alone. A clean
+	 * restart keeps the log, but we cannot tell them apart.
+	 */
+	if (table->unlogged_since)
+	{
+		params[0] = table->unlogged_since;
+		res = pgut_execute(conn2,
+			"SELECT pg_postmaster_start_time() = $1::timestamptz", 1, params);
+		if (strcmp(getstr(res, 0, 0), "t") != 0)
+		{
+			CLEARPGRES(res);
+			elog(WARNING, "server restarted while repacking table \"%s\", its unlogged log may have lost changes",
+				 table->target_name);
+			goto cleanup;
+		}
+		CLEARPGRES(res);
+	}
+
+	if (!table->capture_logical)
+	{
+		register_apply(conn2, table, table->sql_peek);
+		INSTR_TIME_SET_CURRENT(start);
+		num = apply_log(conn2, table, 0);
+		INSTR_TIME_SET_CURRENT(end);
+		INSTR_TIME_SUBTRACT(end, start);
+		elog(DEBUG2, "applied %d changes under the exclusive lock in %.0f ms",
+			 num, INSTR_TIME_GET_MILLISEC(end));
+	}
 	params[0] = utoa(table->target_oid, buffer);
 	pgut_command(conn2, "SELECT repack.repack_swap($1)", 1, params);
 	pgut_command(conn2, "COMMIT", 0, NULL);
@@ -1727,6 +3033,8 @@ cleanup:
 	termStringInfo(&sql);
 	if (vxid)
 		free(vxid);
+	if (slot_name)
+		free(slot_name);
 
 	/* Rollback current transactions */
 	pgut_rollback(connection);
@@ -2493,4 +3801,11 @@ pgut_help(bool details)
 	printf("      --error-on-invalid-index       don't repack when invalid index is found, deprecated, as this is the default behavior now\n");
 	printf("      --apply-count                  number of tuples to apply in one transaction during replay\n");
 	printf("      --switch-threshold             switch tables when that many tuples are left to catchup\n");
+	printf("      --capture=METHOD               capture changes with row (default) or statement level triggers, logical decoding, or a shared memory ring\n");
+	printf("      --key-only-log                 log only the keys of the modified rows, read the rows back on apply\n");
+	printf("      --unlogged-log                 do not write the log tables to the WAL, give up if the server restarts\n");
+	printf("      --max-swap-apply-ms=MS         size the replay to apply the last changes within MS milliseconds at the switch\n");
+	printf("      --catchup-horizon=SECS         give up tables whose replay is not expected to catch up within SECS seconds\n");
+	printf("      --apply-during-build           replay the log while the indexes are built, building them one at a time\n");
+	printf("      --apply-fillfactor=PCT         fill the pages of the new table to at most PCT percent, for the replayed updates to be HOT; the free space is kept after the swap\n");
 }
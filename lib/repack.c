@@ -13,6 +13,7 @@
 #include "access/genam.h"
 #include "access/transam.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "catalog/dependency.h"
 #include "catalog/indexing.h"
 #include "catalog/namespace.h"
@@ -40,35 +41,68 @@
 #include "catalog/pg_inherits_fn.h"
 #endif
 #include "catalog/pg_namespace.h"
+#include "catalog/pg_collation.h"
 #include "catalog/pg_opclass.h"
 #include "catalog/pg_type.h"
 #include "commands/tablecmds.h"
 #include "commands/trigger.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 #include "storage/lmgr.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/plancache.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
 #include "utils/syscache.h"
+#include "utils/typcache.h"
 
 #include "pgut/pgut-spi.h"
 #include "pgut/pgut-be.h"
 
+#include "repack_ring.h"
+#include "repack_stats.h"
+
 #include "access/htup_details.h"
 
+/* executor level apply of the log, see repack_apply_direct */
+#if PG_VERSION_NUM >= 140000
+#include "access/nbtree.h"
+#include "access/stratnum.h"
+#include "access/tableam.h"
+#include "executor/executor.h"
+#include "utils/snapmgr.h"
+#if PG_VERSION_NUM >= 160000
+#include "parser/parse_relation.h"
+#endif
+#endif
+
 /* builtins.h was reorganized for 9.5, so now we need this header */
 #if PG_VERSION_NUM >= 90500
 #include "utils/ruleutils.h"
 #endif
 
+/* format_type_be moved out of builtins.h in 11 */
+#if PG_VERSION_NUM >= 110000
+#include "utils/format_type.h"
+#endif
+
 PG_MODULE_MAGIC;
 
+extern void PGUT_EXPORT _PG_init(void);
 extern Datum PGUT_EXPORT repack_version(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_trigger(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_apply(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_apply_batch(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_apply_direct(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_key_part(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_apply_register(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_apply_registered(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_get_order_by(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_indexdef(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_swap(PG_FUNCTION_ARGS);
@@ -76,10 +110,16 @@ extern Datum PGUT_EXPORT repack_drop(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_disable_autovacuum(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_index_swap(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT repack_get_table_and_inheritors(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_flush_wal(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(repack_version);
 PG_FUNCTION_INFO_V1(repack_trigger);
 PG_FUNCTION_INFO_V1(repack_apply);
+PG_FUNCTION_INFO_V1(repack_apply_batch);
+PG_FUNCTION_INFO_V1(repack_apply_direct);
+PG_FUNCTION_INFO_V1(repack_key_part);
+PG_FUNCTION_INFO_V1(repack_apply_register);
+PG_FUNCTION_INFO_V1(repack_apply_registered);
 PG_FUNCTION_INFO_V1(repack_get_order_by);
 PG_FUNCTION_INFO_V1(repack_indexdef);
 PG_FUNCTION_INFO_V1(repack_swap);
@@ -87,19 +127,56 @@ PG_FUNCTION_INFO_V1(repack_drop);
 PG_FUNCTION_INFO_V1(repack_disable_autovacuum);
 PG_FUNCTION_INFO_V1(repack_index_swap);
 PG_FUNCTION_INFO_V1(repack_get_table_and_inheritors);
+PG_FUNCTION_INFO_V1(repack_flush_wal);
 
 static void	repack_init(void);
 static SPIPlanPtr repack_prepare(const char *src, int nargs, Oid *argtypes);
 static const char *get_quoted_relname(Oid oid);
 static const char *get_quoted_nspname(Oid oid);
 static void swap_heap_or_index_files(Oid r1, Oid r2);
+static void drop_repack_triggers(Oid relid, const char *nspname, const char *relname);
+static void trigger_plan_invalidate(Datum arg, Oid relid);
+static bool tuple_unchanged(HeapTuple oldtuple, HeapTuple newtuple);
 
+/*
+ * Names of the triggers pg_repack may install on the target table, as a SQL
+ * list: a single row level trigger, or one statement level trigger per event.
+ */
+#define REPACK_TRIGGER_NAMES \
+	"'repack_trigger', 'repack_trigger_insert', " \
+	"'repack_trigger_update', 'repack_trigger_delete'"
+
+/*
+ * Row image of tuple, as a composite datum.  External values are fetched into
+ * it but stay compressed, and they are not compressed again in the log (see
+ * repack.create_log_table), nor when the row is inserted into the new table.
+ */
 #define copy_tuple(tuple, desc) \
 	PointerGetDatum(SPI_returntuple((tuple), (desc)))
 
 #define IsToken(c) \
 	(IS_HIGHBIT_SET((c)) || isalnum((unsigned char) (c)) || (c) == '_')
 
+/*
+ * Shared memory capture and statistics need the library to be listed in
+ * shared_preload_libraries; otherwise there is nothing to set up.
+ */
+void
+_PG_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	repack_ring_init();
+	repack_stats_init();
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("pg_repack");
+#else
+	EmitWarningsOnPlaceholders("pg_repack");
+#endif
+}
+
 /* check access authority */
 static void
 must_be_owner(Oid relId)
@@ -151,215 +228,1797 @@ repack_version(PG_FUNCTION_ARGS)
 	return CStringGetTextDatum("pg_repack " LIBRARY_VERSION);
 }
 
+/*
+ * Saved INSERT plans used by repack_trigger, one set per table and trigger.
+ *
+ * The trigger arguments and events never change for a given trigger OID, so
+ * the pair (relid, tgoid) identifies the statement text.  Row triggers need a
+ * single plan; the statement level trigger for UPDATE needs two, one logging
+ * the old keys as deletions and one logging the new rows as insertions.
+ * The row trigger passes the key columns as parameters, followed by the new
+ * row unless the log table has no row column (--key-only-log).
+ * Entries are marked invalid by a relcache callback and rebuilt on next use;
+ * the plans themselves are freed lazily because it is not safe to do it from
+ * inside the callback.
+ */
+#define MAX_TRIGGER_PLANS	2
+
+typedef struct TriggerPlanKey
+{
+	Oid			relid;		/* table the trigger is defined on */
+	Oid			tgoid;		/* OID of the repack trigger */
+} TriggerPlanKey;
+
+typedef struct TriggerPlanEntry
+{
+	TriggerPlanKey	key;	/* hash key (must be first) */
+	bool		valid;		/* false if the table was invalidated */
+	bool		keys_only;	/* the log table has no row column */
+	int			nkeys;		/* number of key columns */
+	AttrNumber	keys[INDEX_MAX_KEYS];	/* attnums of the key columns */
+	int			nplans;		/* number of saved plans */
+	SPIPlanPtr	plans[MAX_TRIGGER_PLANS];
+} TriggerPlanEntry;
+
+static HTAB *trigger_plans = NULL;
+
+/*
+ * Relcache invalidation callback: forget the plans of the invalidated table,
+ * or of every table if relid is InvalidOid.
+ */
+static void
+trigger_plan_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS		status;
+	TriggerPlanEntry   *entry;
+
+	if (trigger_plans == NULL)
+		return;
+
+	hash_seq_init(&status, trigger_plans);
+	while ((entry = (TriggerPlanEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (relid == InvalidOid || entry->key.relid == relid)
+			entry->valid = false;
+	}
+}
+
+static void
+free_trigger_plans(TriggerPlanEntry *entry)
+{
+	for (int i = 0; i < entry->nplans; i++)
+		SPI_freeplan(entry->plans[i]);
+	entry->nplans = 0;
+}
+
+/* append "pk1, pk2, ..." for the key columns of the log table */
+static void
+append_log_keys(StringInfo sql, int nkeys)
+{
+	for (int i = 0; i < nkeys; i++)
+		appendStringInfo(sql, "%spk%d", (i > 0 ? ", " : ""), i + 1);
+}
+
+/* append "alias.col1, alias.col2, ..." for the key columns of the trigger */
+static void
+append_key_columns(StringInfo sql, Trigger *trigger, const char *alias)
+{
+	for (int i = 0; i < trigger->tgnargs; ++i)
+		appendStringInfo(sql, "%s%s.%s", (i > 0 ? ", " : ""),
+						 alias, quote_identifier(trigger->tgargs[i]));
+}
+
+#if PG_VERSION_NUM >= 100000
+/* append "alias.col1, alias.col2, ..." for all the live columns of desc */
+static void
+append_row_columns(StringInfo sql, TupleDesc desc, const char *alias)
+{
+	bool		first = true;
+
+	for (int i = 0; i < desc->natts; i++)
+	{
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute attr = TupleDescAttr(desc, i);
+#else
+		Form_pg_attribute attr = desc->attrs[i];
+#endif
+
+		if (attr->attisdropped)
+			continue;
+		appendStringInfo(sql, "%s%s.%s", (first ? "" : ", "),
+						 alias, quote_identifier(NameStr(attr->attname)));
+		first = false;
+	}
+}
+#endif
+
+/*
+ * Return the saved INSERT plans for the log table of the trigger's relation,
+ * preparing them on first use.  Must be called while connected to SPI, and
+ * after registering the transition tables for statement level triggers.
+ */
+static TriggerPlanEntry *
+get_trigger_plans(TriggerData *trigdata)
+{
+	TriggerPlanKey		key;
+	TriggerPlanEntry   *entry;
+	bool				found;
+	Relation			rel = trigdata->tg_relation;
+	Oid					relid = RelationGetRelid(rel);
+	Trigger			   *trigger = trigdata->tg_trigger;
+	const char		   *sql[MAX_TRIGGER_PLANS];
+	int					nsql = 0;
+	StringInfoData		buf;
+	Oid					argtypes[INDEX_MAX_KEYS];
+	int					nargs = 0;
+	char				logname[NAMEDATALEN];
+
+	if (trigger_plans == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(TriggerPlanKey);
+		ctl.entrysize = sizeof(TriggerPlanEntry);
+		trigger_plans = hash_create("pg_repack trigger plans", 16, &ctl,
+									HASH_ELEM | HASH_BLOBS);
+		CacheRegisterRelcacheCallback(trigger_plan_invalidate, (Datum) 0);
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.relid = relid;
+	key.tgoid = trigger->tgoid;
+
+	entry = (TriggerPlanEntry *) hash_search(trigger_plans, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		HASH_SEQ_STATUS		status;
+		TriggerPlanEntry   *stale;
+
+		entry->valid = false;
+		entry->nplans = 0;
+
+		/*
+		 * Release the plans of triggers which were installed on the table
+		 * by an older repack and will never fire again.  The statement level
+		 * triggers of the current repack are created together, so only drop
+		 * entries of triggers which do not exist any more.
+		 */
+		hash_seq_init(&status, trigger_plans);
+		while ((stale = (TriggerPlanEntry *) hash_seq_search(&status)) != NULL)
+		{
+			bool	exists = false;
+
+			if (stale->key.relid != relid || stale->key.tgoid == key.tgoid)
+				continue;
+			for (int i = 0; rel->trigdesc && i < rel->trigdesc->numtriggers; i++)
+			{
+				if (rel->trigdesc->triggers[i].tgoid == stale->key.tgoid)
+					exists = true;
+			}
+			if (!exists)
+			{
+				free_trigger_plans(stale);
+				hash_search(trigger_plans, &stale->key, HASH_REMOVE, NULL);
+			}
+		}
+	}
+
+	if (entry->valid)
+		return entry;
+
+	free_trigger_plans(entry);
+
+	snprintf(logname, NAMEDATALEN, "log_%u", relid);
+	entry->keys_only = get_attnum(
+		get_relname_relid(logname, get_namespace_oid("repack", false)),
+		"row") == InvalidAttrNumber;
+
+	if (trigger->tgnargs > INDEX_MAX_KEYS)
+		elog(ERROR, "repack_trigger: too many key columns");
+	entry->nkeys = trigger->tgnargs;
+	for (int i = 0; i < trigger->tgnargs; i++)
+	{
+		entry->keys[i] = SPI_fnumber(RelationGetDescr(rel), trigger->tgargs[i]);
+		if (entry->keys[i] <= 0)
+			elog(ERROR, "repack_trigger: column \"%s\" not found",
+				 trigger->tgargs[i]);
+	}
+
+	if (TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+	{
+		/* the keys of oldtup and newtup passed as arguments, see log_change */
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "INSERT INTO repack.log_%u(", relid);
+		append_log_keys(&buf, entry->nkeys);
+		appendStringInfoString(&buf, entry->keys_only ? ") VALUES(" : ", row) VALUES(");
+		for (int i = 0; i < entry->nkeys; i++)
+		{
+			appendStringInfo(&buf, "%s$%d", (i > 0 ? ", " : ""), i + 1);
+			argtypes[i] = SPI_gettypeid(RelationGetDescr(rel), entry->keys[i]);
+		}
+		nargs = entry->nkeys;
+		if (!entry->keys_only)
+		{
+			appendStringInfo(&buf, ", $%d", nargs + 1);
+			argtypes[nargs++] = rel->rd_rel->reltype;
+		}
+		appendStringInfoChar(&buf, ')');
+		sql[nsql++] = buf.data;
+	}
+#if PG_VERSION_NUM >= 100000
+	else
+	{
+		/*
+		 * UPDATE is logged as the deletion of the old keys followed by the
+		 * insertion of the new rows: the transition tables don't tell which
+		 * new row comes from which old one.
+		 */
+		if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		{
+			initStringInfo(&buf);
+			appendStringInfo(&buf, "INSERT INTO repack.log_%u(", relid);
+			append_log_keys(&buf, entry->nkeys);
+			appendStringInfoString(&buf, ") SELECT ");
+			append_key_columns(&buf, trigger, "o");
+			appendStringInfoString(&buf, " FROM repack_old o");
+			sql[nsql++] = buf.data;
+		}
+		if (!TRIGGER_FIRED_BY_DELETE(trigdata->tg_event) && entry->keys_only)
+		{
+			initStringInfo(&buf);
+			appendStringInfo(&buf, "INSERT INTO repack.log_%u(", relid);
+			append_log_keys(&buf, entry->nkeys);
+			appendStringInfoString(&buf, ") SELECT ");
+			append_key_columns(&buf, trigger, "n");
+			appendStringInfoString(&buf, " FROM repack_new n");
+			sql[nsql++] = buf.data;
+		}
+		else if (!TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+		{
+			initStringInfo(&buf);
+			appendStringInfo(&buf, "INSERT INTO repack.log_%u(row) "
+				"SELECT ROW(", relid);
+			append_row_columns(&buf, RelationGetDescr(rel), "n");
+			appendStringInfoString(&buf, ") FROM repack_new n");
+			sql[nsql++] = buf.data;
+		}
+	}
+#endif
+
+	for (int i = 0; i < nsql; i++)
+	{
+		SPIPlanPtr	plan = repack_prepare(sql[i], nargs, argtypes);
+
+		if (SPI_keepplan(plan) != 0)
+			elog(ERROR, "pg_repack: SPI_keepplan failed");
+		entry->plans[entry->nplans++] = plan;
+		pfree((char *) sql[i]);
+	}
+	entry->valid = true;
+
+	return entry;
+}
+
+/*
+ * Log a change: the key of keytuple (NULL for an INSERT) and, unless the log
+ * is key-only, the new row rowtuple (NULL for a DELETE).  Returns the size of
+ * the values logged.
+ */
+static Size
+log_change(TriggerPlanEntry *entry, HeapTuple keytuple, HeapTuple rowtuple,
+		   TupleDesc desc)
+{
+	Datum		values[INDEX_MAX_KEYS + 1];
+	char		nulls[INDEX_MAX_KEYS + 1];
+	int			n = entry->nkeys;
+	Size		bytes = 0;
+
+	for (int i = 0; i < n; i++)
+	{
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute attr = TupleDescAttr(desc, entry->keys[i] - 1);
+#else
+		Form_pg_attribute attr = desc->attrs[entry->keys[i] - 1];
+#endif
+		bool	isnull = true;
+
+		values[i] = keytuple ?
+			heap_getattr(keytuple, entry->keys[i], desc, &isnull) : (Datum) 0;
+		nulls[i] = isnull ? 'n' : ' ';
+		if (!isnull)
+			bytes += datumGetSize(values[i], attr->attbyval, attr->attlen);
+	}
+	if (!entry->keys_only)
+	{
+		values[n] = rowtuple ? copy_tuple(rowtuple, desc) : (Datum) 0;
+		nulls[n] = rowtuple ? ' ' : 'n';
+		if (rowtuple)
+			bytes += VARSIZE(DatumGetPointer(values[n]));
+	}
+	execute_plan(SPI_OK_INSERT, entry->plans[0], values, nulls);
+
+	return bytes;
+}
+
+/* true if the key columns of oldtuple and newtuple may differ */
+static bool
+key_changed(TriggerPlanEntry *entry, HeapTuple oldtuple, HeapTuple newtuple,
+			TupleDesc desc)
+{
+	for (int i = 0; i < entry->nkeys; i++)
+	{
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute attr = TupleDescAttr(desc, entry->keys[i] - 1);
+#else
+		Form_pg_attribute attr = desc->attrs[entry->keys[i] - 1];
+#endif
+		Datum	d1, d2;
+		bool	isnull1, isnull2;
+
+		d1 = heap_getattr(oldtuple, entry->keys[i], desc, &isnull1);
+		d2 = heap_getattr(newtuple, entry->keys[i], desc, &isnull2);
+		if (isnull1 != isnull2 ||
+			(!isnull1 && !datumIsEqual(d1, d2, attr->attbyval, attr->attlen)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Whether an UPDATE left the row as it was: the new version has the same
+ * null bitmap and the same data, byte for byte.  Unchanged toasted values
+ * keep their toast pointer, so they compare equal too.  Equal values with
+ * a different representation are reported as changed, which only means
+ * that the UPDATE is logged.
+ */
+static bool
+tuple_unchanged(HeapTuple oldtuple, HeapTuple newtuple)
+{
+	HeapTupleHeader	oldtup = oldtuple->t_data;
+	HeapTupleHeader	newtup = newtuple->t_data;
+	Size			off = offsetof(HeapTupleHeaderData, t_bits);
+
+	if (oldtuple->t_len != newtuple->t_len ||
+		oldtup->t_hoff != newtup->t_hoff ||
+		HeapTupleHeaderGetNatts(oldtup) != HeapTupleHeaderGetNatts(newtup) ||
+		(oldtup->t_infomask & HEAP_HASNULL) !=
+		(newtup->t_infomask & HEAP_HASNULL))
+		return false;
+
+	return memcmp((char *) oldtup + off, (char *) newtup + off,
+				  oldtuple->t_len - off) == 0;
+}
+
+/*
+ * The work of repack_trigger: log the change, counting in *rows and *bytes
+ * the changes logged and their size.  The size is not known for statement
+ * level triggers, whose rows are logged by INSERT ... SELECT.
+ */
+static Datum
+capture_change(TriggerData *trigdata, uint64 *rows, Size *bytes)
+{
+	TriggerPlanEntry *entry;
+	TupleDesc		desc;
+	HeapTuple		tuple;
+
+	if (!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+	{
+#if PG_VERSION_NUM >= 100000
+		if ((!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event) &&
+			 trigdata->tg_oldtable == NULL) ||
+			(!TRIGGER_FIRED_BY_DELETE(trigdata->tg_event) &&
+			 trigdata->tg_newtable == NULL))
+			elog(ERROR, "repack_trigger: transition tables are missing");
+
+		/* connect to SPI manager */
+		repack_init();
+
+		if (SPI_register_trigger_data(trigdata) != SPI_OK_TD_REGISTER)
+			elog(ERROR, "repack_trigger: SPI_register_trigger_data failed");
+
+		entry = get_trigger_plans(trigdata);
+		for (int i = 0; i < entry->nplans; i++)
+		{
+			execute_plan(SPI_OK_INSERT, entry->plans[i], NULL, NULL);
+			*rows += SPI_processed;
+		}
+
+		SPI_finish();
+
+		return PointerGetDatum(NULL);
+#else
+		elog(ERROR, "repack_trigger: invalid trigger call");
+#endif
+	}
+
+	/* an UPDATE which changed nothing has nothing to replay */
+	if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) &&
+		tuple_unchanged(trigdata->tg_trigtuple, trigdata->tg_newtuple))
+	{
+		repack_stats_noop_update(RelationGetRelid(trigdata->tg_relation),
+								 trigdata->tg_trigger->tgoid);
+		return PointerGetDatum(trigdata->tg_newtuple);
+	}
+
+	/* tables registered by repack.ring_register() are logged in memory */
+	if (repack_ring_append(trigdata, bytes))
+	{
+		*rows = 1;
+		return PointerGetDatum(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) ?
+							   trigdata->tg_newtuple : trigdata->tg_trigtuple);
+	}
+
+	/* retrieve parameters */
+	desc = RelationGetDescr(trigdata->tg_relation);
+
+	/* connect to SPI manager */
+	repack_init();
+
+	entry = get_trigger_plans(trigdata);
+
+	if (entry->keys_only)
+	{
+		HeapTuple	newtuple = NULL;
+
+		/* log the old key, and the new one if the UPDATE changed it */
+		if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+			newtuple = trigdata->tg_trigtuple;
+		else
+		{
+			*bytes += log_change(entry, trigdata->tg_trigtuple, NULL, desc);
+			*rows += 1;
+			if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) &&
+				key_changed(entry, trigdata->tg_trigtuple,
+							trigdata->tg_newtuple, desc))
+				newtuple = trigdata->tg_newtuple;
+		}
+		if (newtuple)
+		{
+			*bytes += log_change(entry, newtuple, NULL, desc);
+			*rows += 1;
+		}
+
+		SPI_finish();
+
+		return PointerGetDatum(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) ?
+							   trigdata->tg_newtuple : trigdata->tg_trigtuple);
+	}
+
+	*rows = 1;
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+	{
+		/* INSERT: (NULL, newtup) */
+		tuple = trigdata->tg_trigtuple;
+		*bytes = log_change(entry, NULL, tuple, desc);
+	}
+	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+	{
+		/* DELETE: (oldtup, NULL) */
+		tuple = trigdata->tg_trigtuple;
+		*bytes = log_change(entry, tuple, NULL, desc);
+	}
+	else if (key_changed(entry, trigdata->tg_trigtuple,
+						 trigdata->tg_newtuple, desc))
+	{
+		/*
+		 * UPDATE of the key: (oldtup, NULL) then (NULL, newtup), so that
+		 * every change of the log concerns a single key and the log can be
+		 * applied in partitions of keys, see apply_log_parallel.
+		 */
+		tuple = trigdata->tg_newtuple;
+		*bytes = log_change(entry, trigdata->tg_trigtuple, NULL, desc);
+		*bytes += log_change(entry, NULL, tuple, desc);
+		*rows = 2;
+	}
+	else
+	{
+		/* UPDATE: (oldtup, newtup) */
+		tuple = trigdata->tg_newtuple;
+		*bytes = log_change(entry, trigdata->tg_trigtuple, tuple, desc);
+	}
+
+	SPI_finish();
+
+	return PointerGetDatum(tuple);
+}
+
 /**
  * @fn      Datum repack_trigger(PG_FUNCTION_ARGS)
  * @brief   Insert a operation log into log-table.
  *
  * repack_trigger(column1, ..., columnN)
  *
+ * Called either as a row level trigger, or (on PostgreSQL 10 and later) as a
+ * statement level trigger with transition tables named repack_old and
+ * repack_new, in which case all the rows affected by the statement are
+ * logged at once.  If the log table has no row column, only the keys of
+ * the modified rows are logged.  Row level UPDATEs which change nothing are
+ * not logged at all.  When pg_repack is in shared_preload_libraries, the
+ * calls are counted and timed for repack.capture_stats().
+ *
  * @param	column1		A column of the table in primary key/unique index.
  * ...
  * @param	columnN		A column of the table in primary key/unique index.
  */
-Datum
-repack_trigger(PG_FUNCTION_ARGS)
+Datum
+repack_trigger(PG_FUNCTION_ARGS)
+{
+	TriggerData	   *trigdata = (TriggerData *) fcinfo->context;
+	instr_time		start;
+	instr_time		duration;
+	uint64			rows = 0;
+	Size			bytes = 0;
+	Datum			result;
+
+	/* make sure it's called as a trigger at all */
+	if (!CALLED_AS_TRIGGER(fcinfo) ||
+		!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+		trigdata->tg_trigger->tgnargs < 1)
+		elog(ERROR, "repack_trigger: invalid trigger call");
+
+	if (!repack_stats_enabled())
+		return capture_change(trigdata, &rows, &bytes);
+
+	INSTR_TIME_SET_CURRENT(start);
+	result = capture_change(trigdata, &rows, &bytes);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	repack_stats_capture(RelationGetRelid(trigdata->tg_relation),
+						 trigdata->tg_trigger->tgoid, rows, bytes,
+						 INSTR_TIME_GET_MICROSEC(duration));
+
+	return result;
+}
+
+/**
+ * @fn      Datum repack_key_part(PG_FUNCTION_ARGS)
+ * @brief   Partition of a key among nparts.
+ *
+ * repack_key_part(nparts, key1, key2, ...)
+ *
+ * The key columns are hashed with the hash functions of their types, so that
+ * equal keys fall in the same partition even when their binary images
+ * differ.  Used to split the log between the workers, see
+ * repack.get_log_part_key().
+ *
+ * @param	nparts	Number of partitions.
+ * @param	key1..	Values of the key columns.
+ * @retval			Partition of the key, from 0 to nparts - 1.
+ */
+Datum
+repack_key_part(PG_FUNCTION_ARGS)
+{
+	int32		nparts = PG_GETARG_INT32(0);
+	Oid			collid = PG_GET_COLLATION();
+	uint32		hash = 0;
+
+	if (nparts <= 0)
+		elog(ERROR, "repack_key_part: nparts must be positive");
+	if (get_fn_expr_variadic(fcinfo->flinfo))
+		elog(ERROR, "repack_key_part: keys must be passed as arguments");
+
+	/* deterministic collations hash the same whichever they are */
+	if (!OidIsValid(collid))
+		collid = DEFAULT_COLLATION_OID;
+
+	for (int i = 1; i < PG_NARGS(); i++)
+	{
+		Oid				typid = get_fn_expr_argtype(fcinfo->flinfo, i);
+		TypeCacheEntry *typentry;
+
+		typentry = lookup_type_cache(typid, TYPECACHE_HASH_PROC_FINFO);
+		if (!OidIsValid(typentry->hash_proc_finfo.fn_oid))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_FUNCTION),
+					 errmsg("could not identify a hash function for type %s",
+							format_type_be(typid))));
+
+		/* combined like the elements of an array, see hash_array */
+		hash = (hash << 5) - hash +
+			DatumGetUInt32(FunctionCall1Coll(&typentry->hash_proc_finfo,
+											 collid, PG_GETARG_DATUM(i)));
+	}
+
+	PG_RETURN_INT32((int32) (hash % (uint32) nparts));
+}
+
+#define DEFAULT_PEEK_COUNT	1000
+
+/* one dimensional array of the n values of type elemtype */
+static Datum
+make_array(Datum *values, int n, Oid elemtype)
+{
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+
+	return PointerGetDatum(construct_array(values, n, elemtype,
+										   typlen, typbyval, typalign));
+}
+
+/*
+ * Statements applying the log of a table, and their plans, prepared on first
+ * use.  They are saved if keep is set, for the statements registered by
+ * repack.apply_register(), see repack_apply_registered.
+ */
+typedef struct ApplyPlans
+{
+	char	   *sql_peek;
+	char	   *sql_insert;		/* set-based statements of repack_apply_batch */
+	char	   *sql_delete;
+	char	   *sql_pop;		/* NULL if sql_peek consumes the changes */
+	SPIPlanPtr	plan_peek;
+	SPIPlanPtr	plan_insert;
+	SPIPlanPtr	plan_delete;
+	SPIPlanPtr	plan_pop;
+	bool		keep;			/* save the plans */
+	bool		windowed;		/* sql_peek groups a window of the log by key */
+} ApplyPlans;
+
+static SPIPlanPtr
+prepare_apply_plan(ApplyPlans *plans, const char *sql, int nargs, Oid *argtypes)
+{
+	SPIPlanPtr	plan = repack_prepare(sql, nargs, argtypes);
+
+	if (plans->keep && SPI_keepplan(plan) != 0)
+		elog(ERROR, "pg_repack: SPI_keepplan failed");
+	return plan;
+}
+
+/*
+ * Delete from the log table the ntuples changes of tuptable, whose first
+ * column is their id, or an array of ids.  sql_pop is a DELETE taking the
+ * ids as a bigint[] $1, prepared in *plan on first use.
+ */
+static void
+pop_applied(SPIPlanPtr *plan, const char *sql_pop, SPITupleTable *tuptable,
+			int ntuples)
+{
+	TupleDesc	desc = tuptable->tupdesc;
+	bool		is_array = (SPI_gettypeid(desc, 1) != INT8OID);
+	Datum	   *ids;
+	int			nids = 0;
+	int			maxids = ntuples;
+	Datum		values[1];
+
+	Assert(ntuples > 0);
+
+	if (*plan == NULL)
+	{
+		Oid		argtypes[1];
+
+		argtypes[0] = get_array_type(INT8OID);
+		*plan = repack_prepare(sql_pop, 1, argtypes);
+	}
+
+	ids = palloc(sizeof(Datum) * maxids);
+	for (int i = 0; i < ntuples; i++)
+	{
+		bool	isnull;
+		Datum	id = SPI_getbinval(tuptable->vals[i], desc, 1, &isnull);
+
+		Assert(!isnull);
+		if (is_array)
+		{
+			Datum  *elems;
+			int		nelems;
+
+			/* the ids of all the log rows of a key, see get_sql_peek_keys */
+			deconstruct_array(DatumGetArrayTypeP(id), INT8OID, sizeof(int64),
+							  FLOAT8PASSBYVAL, 'd', &elems, NULL, &nelems);
+			if (nids + nelems > maxids)
+			{
+				maxids = Max(maxids * 2, nids + nelems);
+				ids = repalloc(ids, sizeof(Datum) * maxids);
+			}
+			memcpy(&ids[nids], elems, sizeof(Datum) * nelems);
+			nids += nelems;
+			pfree(elems);
+		}
+		else
+			ids[nids++] = id;
+	}
+
+	values[0] = make_array(ids, nids, INT8OID);
+	execute_plan(SPI_OK_DELETE, *plan, values, NULL);
+
+	pfree(DatumGetPointer(values[0]));
+	pfree(ids);
+}
+
+/*
+ * Fetch into SPI_tuptable the next changes to apply, at most
+ * DEFAULT_PEEK_COUNT and count - n if count > 0, and return their number.
+ * Unless sql_peek consumes the changes, it is run once per call as a cursor,
+ * with no limit if count <= 0, and read DEFAULT_PEEK_COUNT changes at a
+ * time: the scan of the log goes on from the last change fetched instead of
+ * starting again through the entries popped by the previous batches.
+ *
+ * The peek of a key-only log, see get_sql_peek_keys, is run once per batch
+ * instead: it groups the log rows by key, and without its LIMIT the whole
+ * log would be aggregated before the first key is returned.  Each batch
+ * groups the next window of the log, those of the previous one being popped.
+ */
+static uint64
+apply_peek(ApplyPlans *plans, Portal *cursor, int32 count, uint32 n)
+{
+	Oid			argtypes[1] = { INT4OID };
+	Datum		values[1];
+	char		nulls[1] = { ' ' };
+	long		limit;
+
+	limit = (count <= 0 ? DEFAULT_PEEK_COUNT : Min(count - n, DEFAULT_PEEK_COUNT));
+
+	if (plans->sql_pop == NULL)
+	{
+		if (plans->plan_peek == NULL)
+			plans->plan_peek = prepare_apply_plan(plans, plans->sql_peek, 1,
+												  argtypes);
+		values[0] = Int32GetDatum((int32) limit);
+		execute_plan(SPI_OK_SELECT, plans->plan_peek, values, nulls);
+		return SPI_processed;
+	}
+
+	if (plans->plan_peek == NULL)
+	{
+		CachedPlanSource *source;
+
+		/* planned to return the first changes soon, as an index scan */
+		plans->plan_peek = SPI_prepare_cursor(plans->sql_peek, 1, argtypes,
+											  CURSOR_OPT_FAST_PLAN);
+		if (plans->plan_peek == NULL)
+			elog(ERROR, "pg_repack: SPI_prepare_cursor failed (code=%d, query=%s)",
+				 SPI_result, plans->sql_peek);
+		if (plans->keep && SPI_keepplan(plans->plan_peek) != 0)
+			elog(ERROR, "pg_repack: SPI_keepplan failed");
+
+		/* the ids of a key are returned as an array, as in pop_applied */
+		source = (CachedPlanSource *)
+			linitial(SPI_plan_get_plan_sources(plans->plan_peek));
+		plans->windowed = (source->resultDesc != NULL &&
+			TupleDescAttr(source->resultDesc, 0)->atttypid != INT8OID);
+	}
+	if (plans->windowed)
+	{
+		values[0] = Int32GetDatum((int32) limit);
+		execute_plan(SPI_OK_SELECT, plans->plan_peek, values, nulls);
+		return SPI_processed;
+	}
+	if (*cursor == NULL)
+	{
+		/* LIMIT NULL returns all the changes */
+		values[0] = Int32GetDatum(count);
+		nulls[0] = (count > 0 ? ' ' : 'n');
+		*cursor = SPI_cursor_open(NULL, plans->plan_peek, values, nulls, false);
+	}
+	SPI_cursor_fetch(*cursor, true, limit);
+	return SPI_processed;
+}
+
+/* pop_applied with the statement of plans, if there is one */
+static void
+apply_pop(ApplyPlans *plans, SPITupleTable *tuptable, int ntuples)
+{
+	if (plans->sql_pop == NULL)
+		return;
+	if (plans->plan_pop == NULL)
+	{
+		Oid		argtypes[1];
+
+		argtypes[0] = get_array_type(INT8OID);
+		plans->plan_pop = prepare_apply_plan(plans, plans->sql_pop, 1, argtypes);
+	}
+	pop_applied(&plans->plan_pop, plans->sql_pop, tuptable, ntuples);
+}
+
+/**
+ * @fn      Datum repack_apply(PG_FUNCTION_ARGS)
+ * @brief   Apply operations in log table into temp table.
+ *
+ * repack_apply(sql_peek, sql_insert, sql_delete, sql_update, sql_pop,  count)
+ *
+ * sql_peek returns the changes as (id, key1, ..., keyN, row), like the log
+ * table: the keys are NULL for an INSERT, the row is NULL for a DELETE.
+ *
+ * @param	sql_peek	SQL to pop tuple from log table.
+ * @param	sql_insert	SQL to insert into temp table, taking the row as $1.
+ * @param	sql_delete	SQL to delete from temp table, taking the keys as $1..$N.
+ * @param	sql_update	SQL to update temp table, taking the keys and the row
+ *					as $1..$N+1, or NULL to apply updates as a delete followed
+ *					by an insert.
+ * @param	sql_pop	SQL to bulk-delete tuples from log table, taking their
+ *					ids as a bigint[] $1, or NULL if sql_peek consumes the
+ *					tuples it returns.
+ * @param	count		Max number of operations, or no count iff <=0.
+ * @retval				Number of performed operations.
+ */
+Datum
+repack_apply(PG_FUNCTION_ARGS)
+{
+	const char *sql_peek = PG_GETARG_CSTRING(0);
+	const char *sql_insert = PG_GETARG_CSTRING(1);
+	const char *sql_delete = PG_GETARG_CSTRING(2);
+	const char *sql_update = PG_ARGISNULL(3) ? NULL : PG_GETARG_CSTRING(3);
+	/* sql_pop, the fifth arg, will be used in the loop below */
+	bool		pop = !PG_ARGISNULL(4);
+	int32		count = PG_GETARG_INT32(5);
+
+	SPIPlanPtr		plan_peek = NULL;
+	SPIPlanPtr		plan_insert = NULL;
+	SPIPlanPtr		plan_delete = NULL;
+	SPIPlanPtr		plan_update = NULL;
+	uint32			n, i;
+	Oid				argtypes_peek[1] = { INT4OID };
+	Datum			values_peek[1];
+	const char			nulls_peek[1] = { 0 };
+	SPIPlanPtr		plan_pop = NULL;
+
+	/* connect to SPI manager */
+	repack_init();
+
+	/* peek tuple in log */
+	plan_peek = repack_prepare(sql_peek, 1, argtypes_peek);
+
+	for (n = 0;;)
+	{
+		int				ntuples;
+		SPITupleTable  *tuptable;
+		TupleDesc		desc;
+		int				nkeys;
+		Oid				argtypes[INDEX_MAX_KEYS + 2];	/* id, keys, row */
+		Datum			values[INDEX_MAX_KEYS + 2];		/* id, keys, row */
+		char			nulls[INDEX_MAX_KEYS + 2];		/* id, keys, row */
+
+		if (count > 0 && n >= count)
+			break;
+
+		/* peek tuple in log */
+		if (count <= 0)
+			values_peek[0] = Int32GetDatum(DEFAULT_PEEK_COUNT);
+		else
+			values_peek[0] = Int32GetDatum(Min(count - n, DEFAULT_PEEK_COUNT));
+
+		execute_plan(SPI_OK_SELECT, plan_peek, values_peek, nulls_peek);
+		if (SPI_processed <= 0)
+			break;
+
+		/* copy tuptable because we will call other sqls. */
+		ntuples = SPI_processed;
+		tuptable = SPI_tuptable;
+		desc = tuptable->tupdesc;
+		nkeys = desc->natts - 2;
+		if (nkeys < 1 || nkeys > INDEX_MAX_KEYS)
+			elog(ERROR, "pg_repack: unexpected log format");
+		for (int k = 0; k < desc->natts; k++)
+			argtypes[k] = SPI_gettypeid(desc, k + 1);
+
+		for (i = 0; i < ntuples; i++, n++)
+		{
+			HeapTuple	tuple;
+
+			tuple = tuptable->vals[i];
+			for (int k = 0; k < desc->natts; k++)
+			{
+				bool	isnull;
+
+				values[k] = SPI_getbinval(tuple, desc, k + 1, &isnull);
+				nulls[k] = isnull ? 'n' : ' ';
+			}
+
+			if (nulls[1] == 'n')
+			{
+				/* INSERT */
+				if (plan_insert == NULL)
+					plan_insert = repack_prepare(sql_insert, 1, &argtypes[nkeys + 1]);
+				execute_plan(SPI_OK_INSERT, plan_insert, &values[nkeys + 1], &nulls[nkeys + 1]);
+			}
+			else if (nulls[nkeys + 1] == 'n')
+			{
+				/* DELETE */
+				if (plan_delete == NULL)
+					plan_delete = repack_prepare(sql_delete, nkeys, &argtypes[1]);
+				execute_plan(SPI_OK_DELETE, plan_delete, &values[1], &nulls[1]);
+			}
+			else if (sql_update == NULL)
+			{
+				/* UPDATE as DELETE + INSERT, the key may not be there */
+				if (plan_delete == NULL)
+					plan_delete = repack_prepare(sql_delete, nkeys, &argtypes[1]);
+				if (plan_insert == NULL)
+					plan_insert = repack_prepare(sql_insert, 1, &argtypes[nkeys + 1]);
+				execute_plan(SPI_OK_DELETE, plan_delete, &values[1], &nulls[1]);
+				execute_plan(SPI_OK_INSERT, plan_insert, &values[nkeys + 1], &nulls[nkeys + 1]);
+			}
+			else
+			{
+				/* UPDATE */
+				if (plan_update == NULL)
+					plan_update = repack_prepare(sql_update, nkeys + 1, &argtypes[1]);
+				execute_plan(SPI_OK_UPDATE, plan_update, &values[1], &nulls[1]);
+			}
+		}
+
+		/* Bulk delete of processed rows from the log table */
+		if (pop)
+			pop_applied(&plan_pop, PG_GETARG_CSTRING(4), tuptable, ntuples);
+
+		SPI_freetuptable(tuptable);
+	}
+
+	SPI_finish();
+
+	PG_RETURN_INT32(n);
+}
+
+/* the loop of repack_apply_batch, with the statements of plans */
+static uint32
+apply_batch(ApplyPlans *plans, int32 count)
+{
+	uint32			n;
+	Portal			cursor = NULL;
+
+	for (n = 0;;)
+	{
+		int				ntuples;
+		SPITupleTable  *tuptable;
+		TupleDesc		desc;
+		int				nkeys;
+		int				nins = 0;
+		int				ndel = 0;
+		Oid				elemtypes[INDEX_MAX_KEYS + 2];	/* id, keys, row */
+		Oid				argtypes[INDEX_MAX_KEYS + 3];
+		Datum			values[INDEX_MAX_KEYS + 3];
+		Datum		   *ins_pos;
+		Datum		   *ins_rows;
+		Datum		   *del_pos;
+		Datum		   *del_keys[INDEX_MAX_KEYS];
+
+		if (count > 0 && n >= count)
+			break;
+
+		/* peek tuple in log */
+		if (apply_peek(plans, &cursor, count, n) <= 0)
+			break;
+
+		ntuples = SPI_processed;
+		tuptable = SPI_tuptable;
+		desc = tuptable->tupdesc;
+		nkeys = desc->natts - 2;
+		if (nkeys < 1 || nkeys > INDEX_MAX_KEYS)
+			elog(ERROR, "pg_repack: unexpected log format");
+		/* domains have no array type before 11, use their base type */
+		for (int k = 0; k < desc->natts; k++)
+			elemtypes[k] = getBaseType(SPI_gettypeid(desc, k + 1));
+
+		/* split the batch into the rows to insert and the keys to delete */
+		ins_pos = palloc(sizeof(Datum) * ntuples);
+		ins_rows = palloc(sizeof(Datum) * ntuples);
+		del_pos = palloc(sizeof(Datum) * ntuples);
+		for (int k = 0; k < nkeys; k++)
+			del_keys[k] = palloc(sizeof(Datum) * ntuples);
+
+		for (int i = 0; i < ntuples; i++, n++)
+		{
+			HeapTuple	tuple = tuptable->vals[i];
+			bool		isnull;
+			Datum		row;
+
+			/* the keys are all NULL for an INSERT */
+			SPI_getbinval(tuple, desc, 2, &isnull);
+			if (!isnull)
+			{
+				for (int k = 0; k < nkeys; k++)
+					del_keys[k][ndel] = SPI_getbinval(tuple, desc, k + 2, &isnull);
+				del_pos[ndel++] = Int32GetDatum(i);
+			}
+
+			row = SPI_getbinval(tuple, desc, nkeys + 2, &isnull);
+			if (!isnull)
+			{
+				ins_rows[nins] = row;
+				ins_pos[nins++] = Int32GetDatum(i);
+			}
+		}
+
+		if (ndel > 0)
+		{
+			if (plans->plan_delete == NULL)
+			{
+				for (int k = 0; k < nkeys; k++)
+					argtypes[k] = get_array_type(elemtypes[k + 1]);
+				plans->plan_delete = prepare_apply_plan(plans, plans->sql_delete,
+														nkeys, argtypes);
+			}
+			for (int k = 0; k < nkeys; k++)
+				values[k] = make_array(del_keys[k], ndel, elemtypes[k + 1]);
+			execute_plan(SPI_OK_DELETE, plans->plan_delete, values, NULL);
+		}
+
+		if (nins > 0)
+		{
+			if (plans->plan_insert == NULL)
+			{
+				argtypes[0] = INT4ARRAYOID;
+				argtypes[1] = get_array_type(elemtypes[nkeys + 1]);
+				argtypes[2] = INT4ARRAYOID;
+				for (int k = 0; k < nkeys; k++)
+					argtypes[k + 3] = get_array_type(elemtypes[k + 1]);
+				plans->plan_insert = prepare_apply_plan(plans, plans->sql_insert,
+														nkeys + 3, argtypes);
+			}
+			values[0] = make_array(ins_pos, nins, INT4OID);
+			values[1] = make_array(ins_rows, nins, elemtypes[nkeys + 1]);
+			values[2] = make_array(del_pos, ndel, INT4OID);
+			for (int k = 0; k < nkeys; k++)
+				values[k + 3] = make_array(del_keys[k], ndel, elemtypes[k + 1]);
+			execute_plan(SPI_OK_INSERT, plans->plan_insert, values, NULL);
+		}
+
+		/* Bulk delete of processed rows from the log table */
+		apply_pop(plans, tuptable, ntuples);
+
+		SPI_freetuptable(tuptable);
+		pfree(ins_pos);
+		pfree(ins_rows);
+		pfree(del_pos);
+		for (int k = 0; k < nkeys; k++)
+			pfree(del_keys[k]);
+	}
+
+	if (cursor)
+		SPI_cursor_close(cursor);
+
+	return n;
+}
+
+/**
+ * @fn      Datum repack_apply_batch(PG_FUNCTION_ARGS)
+ * @brief   Apply operations in log table into temp table, a batch at a time.
+ *
+ * repack_apply_batch(sql_peek, sql_insert, sql_delete, sql_pop, count)
+ *
+ * Same as repack_apply, but instead of executing a statement for each change,
+ * each batch of changes returned by sql_peek is applied by two statements
+ * taking the changes as arrays: sql_delete deletes all the keys of the batch,
+ * the old keys of the UPDATEs and DELETEs, then sql_insert inserts the rows
+ * of the INSERTs and UPDATEs which are not followed by another change of
+ * their key in the batch.  This gives the same result as applying the
+ * changes one by one in order.
+ *
+ * @param	sql_peek	SQL to pop tuple from log table.
+ * @param	sql_insert	SQL to insert into temp table, taking as $1 the
+ *					positions of the rows in the batch, as $2 the rows, as
+ *					$3 the positions of the keys and as $4..$N+3 the keys.
+ * @param	sql_delete	SQL to delete from temp table, taking the keys as
+ *					$1..$N.
+ * @param	sql_pop	SQL to bulk-delete tuples from log table, taking their
+ *					ids as a bigint[] $1, or NULL if sql_peek consumes the
+ *					tuples it returns.
+ * @param	count		Max number of operations, or no count iff <=0.
+ * @retval				Number of performed operations.
+ */
+Datum
+repack_apply_batch(PG_FUNCTION_ARGS)
+{
+	ApplyPlans	plans;
+	uint32		n;
+
+	memset(&plans, 0, sizeof(plans));
+	plans.sql_peek = PG_GETARG_CSTRING(0);
+	plans.sql_insert = PG_GETARG_CSTRING(1);
+	plans.sql_delete = PG_GETARG_CSTRING(2);
+	plans.sql_pop = PG_ARGISNULL(3) ? NULL : PG_GETARG_CSTRING(3);
+
+	/* connect to SPI manager */
+	repack_init();
+
+	n = apply_batch(&plans, PG_GETARG_INT32(4));
+
+	SPI_finish();
+
+	PG_RETURN_INT32(n);
+}
+
+#if PG_VERSION_NUM >= 140000
+/*
+ * State of repack_apply_direct: the new table, opened once with its indexes
+ * for the executor, and what is needed to look up a row by its key.
+ */
+typedef struct DirectApply
+{
+	Relation		rel;		/* repack.table_<oid> */
+	Relation		index;		/* its index on the key, repack.index_<pkid> */
+	EState		   *estate;
+	ResultRelInfo  *rri;
+	EPQState		epqstate;
+	TupleTableSlot *oldslot;	/* the row found by its key */
+	TupleTableSlot *newslot;	/* the row to insert or update to */
+	int				nkeys;
+	ScanKeyData		skey[INDEX_MAX_KEYS];	/* key = $n, without arguments */
+	FmgrInfo		cmp[INDEX_MAX_KEYS];	/* btree comparison of the keys */
+	bool			coalesce;	/* keep only the last change of each key */
+} DirectApply;
+
+/*
+ * A change of the log, split into changes of a single key: the old key of
+ * an UPDATE changing it is deleted, then the new row inserted.
+ */
+typedef struct DirectChange
+{
+	int				pos;		/* position of the change in the window */
+	Datum		   *keys;		/* the key changed */
+	Datum			row;		/* the new row of the key, unless deleted */
+	bool			deleted;	/* the key is deleted */
+	bool			inserted;	/* the key was not there before the change */
+} DirectChange;
+
+static void
+direct_apply_open(DirectApply *state, Oid relid, Oid pkid)
+{
+	Oid				nspid = get_namespace_oid("repack", false);
+	char			name[NAMEDATALEN];
+	Oid				tableid;
+	Oid				indexid;
+	RangeTblEntry  *rte;
+#if PG_VERSION_NUM >= 160000
+	List		   *perminfos = NIL;
+#endif
+
+	snprintf(name, NAMEDATALEN, "table_%u", relid);
+	tableid = get_relname_relid(name, nspid);
+	snprintf(name, NAMEDATALEN, "index_%u", pkid);
+	indexid = get_relname_relid(name, nspid);
+	if (!OidIsValid(tableid) || !OidIsValid(indexid))
+		elog(ERROR, "pg_repack: repack.table_%u or repack.index_%u not found",
+			 relid, pkid);
+
+	state->rel = table_open(tableid, RowExclusiveLock);
+
+	/* an executor state for the new table alone, as logical replication does */
+	state->estate = CreateExecutorState();
+	rte = makeNode(RangeTblEntry);
+	rte->rtekind = RTE_RELATION;
+	rte->relid = tableid;
+	rte->relkind = state->rel->rd_rel->relkind;
+	rte->rellockmode = RowExclusiveLock;
+#if PG_VERSION_NUM >= 160000
+	addRTEPermissionInfo(&perminfos, rte);
+	ExecInitRangeTable(state->estate, list_make1(rte), perminfos);
+#else
+	ExecInitRangeTable(state->estate, list_make1(rte));
+#endif
+	state->estate->es_output_cid = GetCurrentCommandId(true);
+
+	state->rri = makeNode(ResultRelInfo);
+	InitResultRelInfo(state->rri, state->rel, 1, NULL, 0);
+	ExecOpenIndices(state->rri, false);
+#if PG_VERSION_NUM >= 160000
+	EvalPlanQualInit(&state->epqstate, state->estate, NULL, NIL, -1, NIL);
+#else
+	EvalPlanQualInit(&state->epqstate, state->estate, NULL, NIL, -1);
+#endif
+
+	/*
+	 * Reordering the changes of different keys could make another unique
+	 * index see their rows conflict, only coalesce them without one.
+	 */
+	state->index = NULL;
+	state->coalesce = true;
+	for (int i = 0; i < state->rri->ri_NumIndices; i++)
+	{
+		IndexInfo  *ii = state->rri->ri_IndexRelationInfo[i];
+
+		if (RelationGetRelid(state->rri->ri_IndexRelationDescs[i]) == indexid)
+			state->index = state->rri->ri_IndexRelationDescs[i];
+		else if (ii->ii_Unique || ii->ii_ExclusionOps != NULL)
+			state->coalesce = false;
+	}
+	if (state->index == NULL)
+		elog(ERROR, "pg_repack: index repack.index_%u is not ready", pkid);
+
+	state->oldslot = table_slot_create(state->rel, &state->estate->es_tupleTable);
+	state->newslot = table_slot_create(state->rel, &state->estate->es_tupleTable);
+
+	/* the key is unique and made of plain columns, compare them with = */
+	state->nkeys = IndexRelationGetNumberOfKeyAttributes(state->index);
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		Oid		opfamily = state->index->rd_opfamily[i];
+		Oid		opcintype = state->index->rd_opcintype[i];
+		Oid		eqop = get_opfamily_member(opfamily, opcintype, opcintype,
+										   BTEqualStrategyNumber);
+		Oid		cmpproc = get_opfamily_proc(opfamily, opcintype, opcintype,
+											BTORDER_PROC);
+
+		if (!OidIsValid(eqop) || !OidIsValid(cmpproc))
+			elog(ERROR, "pg_repack: missing btree operators for type %u",
+				 opcintype);
+		ScanKeyEntryInitialize(&state->skey[i], 0, i + 1,
+							   BTEqualStrategyNumber, opcintype,
+							   state->index->rd_indcollation[i],
+							   get_opcode(eqop), (Datum) 0);
+		fmgr_info(cmpproc, &state->cmp[i]);
+	}
+}
+
+static void
+direct_apply_close(DirectApply *state)
+{
+	EvalPlanQualEnd(&state->epqstate);
+	ExecCloseIndices(state->rri);
+	ExecResetTupleTable(state->estate->es_tupleTable, false);
+	FreeExecutorState(state->estate);
+	table_close(state->rel, NoLock);
+}
+
+/* look up the row of the new table with the key values, into oldslot */
+static bool
+direct_apply_find(DirectApply *state, Datum *keys)
+{
+	ScanKeyData		skey[INDEX_MAX_KEYS];
+	IndexScanDesc	scan;
+	bool			found;
+
+	memcpy(skey, state->skey, sizeof(ScanKeyData) * state->nkeys);
+	for (int i = 0; i < state->nkeys; i++)
+		skey[i].sk_argument = keys[i];
+
+	/* our own changes are the only ones to the new table */
+	scan = index_beginscan(state->rel, state->index, SnapshotSelf,
+						   state->nkeys, 0);
+	index_rescan(scan, skey, state->nkeys, NULL, 0);
+	found = index_getnext_slot(scan, ForwardScanDirection, state->oldslot);
+	index_endscan(scan);
+
+	return found;
+}
+
+/* store the row image of the log into newslot */
+static void
+direct_apply_store_row(DirectApply *state, Datum row)
+{
+	HeapTupleHeader	td = DatumGetHeapTupleHeader(row);
+	HeapTupleData	tuple;
+	TupleTableSlot *slot = state->newslot;
+
+	tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+	ItemPointerSetInvalid(&tuple.t_self);
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = td;
+
+	/* the new table has the columns of the original one, at the same place */
+	ExecClearTuple(slot);
+	heap_deform_tuple(&tuple, RelationGetDescr(state->rel),
+					  slot->tts_values, slot->tts_isnull);
+	ExecStoreVirtualTuple(slot);
+}
+
+/*
+ * true if the row found is the same as the new one, column by column: an
+ * UPDATE changed it and another one changed it back, or the key-only log
+ * read the same row again.  The heap already makes an UPDATE HOT when it
+ * does not change the indexed columns, this saves the new row version too.
+ */
+static bool
+direct_apply_unchanged(DirectApply *state)
+{
+	TupleDesc	desc = RelationGetDescr(state->rel);
+
+	slot_getallattrs(state->oldslot);
+	for (int i = 0; i < desc->natts; i++)
+	{
+		Form_pg_attribute attr = TupleDescAttr(desc, i);
+		bool		isnull = state->oldslot->tts_isnull[i];
+
+		if (isnull != state->newslot->tts_isnull[i])
+			return false;
+		if (!isnull &&
+			!datum_image_eq(state->oldslot->tts_values[i],
+							state->newslot->tts_values[i],
+							attr->attbyval, attr->attlen))
+			return false;
+	}
+	return true;
+}
+
+/* the key values of the row image td */
+static Datum *
+direct_apply_row_keys(DirectApply *state, HeapTupleHeader td)
+{
+	HeapTupleData	tuple;
+	Datum		   *keys = palloc(sizeof(Datum) * state->nkeys);
+	bool			isnull;
+
+	tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+	ItemPointerSetInvalid(&tuple.t_self);
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = td;
+
+	for (int i = 0; i < state->nkeys; i++)
+		keys[i] = heap_getattr(&tuple, state->index->rd_index->indkey.values[i],
+							   RelationGetDescr(state->rel), &isnull);
+
+	return keys;
+}
+
+static int
+direct_apply_keys_cmp(DirectApply *state, Datum *keys1, Datum *keys2)
+{
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		int32	c = DatumGetInt32(FunctionCall2Coll(&state->cmp[i],
+													state->index->rd_indcollation[i],
+													keys1[i], keys2[i]));
+
+		if (c != 0)
+			return c;
+	}
+	return 0;
+}
+
+/* order the changes by key, then by position */
+static int
+direct_change_key_cmp(const void *a, const void *b, void *arg)
+{
+	const DirectChange *c1 = (const DirectChange *) a;
+	const DirectChange *c2 = (const DirectChange *) b;
+	int			c = direct_apply_keys_cmp((DirectApply *) arg, c1->keys, c2->keys);
+
+	return c != 0 ? c : c1->pos - c2->pos;
+}
+
+static int
+direct_change_pos_cmp(const void *a, const void *b)
+{
+	return ((const DirectChange *) a)->pos - ((const DirectChange *) b)->pos;
+}
+
+/*
+ * Split the ntuples changes of the log in tuptable into changes of a single
+ * key, stored in order into changes, which has room for 2 * ntuples of them.
+ * When state->coalesce is set, only the last change of each key is kept: it
+ * leaves the key as the whole chain does, and an INSERT followed by a DELETE
+ * leaves nothing to do.  Returns the number of changes.
+ */
+static int
+direct_apply_collect(DirectApply *state, SPITupleTable *tuptable, int ntuples,
+					 DirectChange *changes)
 {
-	TriggerData	   *trigdata = (TriggerData *) fcinfo->context;
-	TupleDesc		desc;
-	HeapTuple		tuple;
-	Datum			values[2];
-	bool			nulls[2] = { 0, 0 };
-	Oid				argtypes[2];
-	Oid				relid;
-	StringInfo		sql;
+	TupleDesc	desc = tuptable->tupdesc;
+	int			nchanges = 0;
+	int			n;
 
-	/* make sure it's called as a trigger at all */
-	if (!CALLED_AS_TRIGGER(fcinfo) ||
-		!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
-		!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) ||
-		trigdata->tg_trigger->tgnargs < 1)
-		elog(ERROR, "repack_trigger: invalid trigger call");
+	for (int i = 0; i < ntuples; i++)
+	{
+		HeapTuple	tuple = tuptable->vals[i];
+		Datum	   *keys = palloc(sizeof(Datum) * state->nkeys);
+		Datum	   *rowkeys = NULL;
+		Datum		row;
+		bool		keys_null;
+		bool		row_null;
+
+		for (int k = 0; k < state->nkeys; k++)
+			keys[k] = SPI_getbinval(tuple, desc, k + 2, &keys_null);
+		row = SPI_getbinval(tuple, desc, state->nkeys + 2, &row_null);
+		if (!row_null)
+		{
+			HeapTupleHeader	td = DatumGetHeapTupleHeader(row);
 
-	relid = RelationGetRelid(trigdata->tg_relation);
+			row = PointerGetDatum(td);
+			rowkeys = direct_apply_row_keys(state, td);
+		}
 
-	/* retrieve parameters */
-	desc = RelationGetDescr(trigdata->tg_relation);
-	argtypes[0] = argtypes[1] = trigdata->tg_relation->rd_rel->reltype;
+		/* DELETE, or UPDATE of the key */
+		if (!keys_null &&
+			(row_null || direct_apply_keys_cmp(state, keys, rowkeys) != 0))
+		{
+			changes[nchanges].pos = nchanges;
+			changes[nchanges].keys = keys;
+			changes[nchanges].row = (Datum) 0;
+			changes[nchanges].deleted = true;
+			changes[nchanges].inserted = false;
+			nchanges++;
+		}
 
-	/* connect to SPI manager */
-	repack_init();
+		/* INSERT, or UPDATE */
+		if (!row_null)
+		{
+			changes[nchanges].pos = nchanges;
+			changes[nchanges].keys = rowkeys;
+			changes[nchanges].row = row;
+			changes[nchanges].deleted = false;
+			changes[nchanges].inserted = keys_null;
+			nchanges++;
+		}
+	}
 
-	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+	if (!state->coalesce || nchanges < 2)
+		return nchanges;
+
+	/* the last change of each key, which was there unless first inserted */
+	qsort_arg(changes, nchanges, sizeof(DirectChange),
+			  direct_change_key_cmp, state);
+	n = 1;
+	for (int i = 1; i < nchanges; i++)
 	{
-		/* INSERT: (NULL, newtup) */
-		tuple = trigdata->tg_trigtuple;
-		nulls[0] = true;
-		values[1] = copy_tuple(tuple, desc);
+		if (direct_apply_keys_cmp(state, changes[n - 1].keys,
+								  changes[i].keys) == 0)
+		{
+			bool	inserted = changes[n - 1].inserted;
+
+			changes[n - 1] = changes[i];
+			changes[n - 1].inserted = inserted;
+		}
+		else
+			changes[n++] = changes[i];
 	}
-	else if (TRIGGER_FIRED_BY_DELETE(trigdata->tg_event))
+	qsort(changes, n, sizeof(DirectChange), direct_change_pos_cmp);
+
+	return n;
+}
+
+/* apply a change of a single key to the new table */
+static void
+direct_apply_change(DirectApply *state, DirectChange *change)
+{
+	if (change->inserted)
 	{
-		/* DELETE: (oldtup, NULL) */
-		tuple = trigdata->tg_trigtuple;
-		values[0] = copy_tuple(tuple, desc);
-		nulls[1] = true;
+		/* INSERT, or nothing if the key was deleted again */
+		if (!change->deleted)
+		{
+			direct_apply_store_row(state, change->row);
+			ExecSimpleRelationInsert(state->rri, state->estate, state->newslot);
+		}
+	}
+	else if (!direct_apply_find(state, change->keys))
+	{
+		/* UPDATE of a row not there yet, or DELETE of a row not there */
+		if (!change->deleted)
+		{
+			direct_apply_store_row(state, change->row);
+			ExecSimpleRelationInsert(state->rri, state->estate, state->newslot);
+		}
+	}
+	else if (change->deleted)
+	{
+		/* DELETE */
+		ExecSimpleRelationDelete(state->rri, state->estate,
+								 &state->epqstate, state->oldslot);
 	}
 	else
 	{
-		/* UPDATE: (oldtup, newtup) */
-		tuple = trigdata->tg_newtuple;
-		values[0] = copy_tuple(trigdata->tg_trigtuple, desc);
-		values[1] = copy_tuple(tuple, desc);
+		/* UPDATE, unless the row is already the new one */
+		direct_apply_store_row(state, change->row);
+		if (!direct_apply_unchanged(state))
+			ExecSimpleRelationUpdate(state->rri, state->estate,
+									 &state->epqstate, state->oldslot,
+									 state->newslot);
 	}
+}
+/* the loop of repack_apply_direct, with the statements of plans */
+static uint32
+apply_direct(ApplyPlans *plans, Oid relid, Oid pkid, int32 count)
+{
+	DirectApply		state;
+	MemoryContext	window_context;
+	uint32			n;
+	Portal			cursor = NULL;
 
-	/* prepare INSERT query */
-	sql = makeStringInfo();
-	appendStringInfo(sql, "INSERT INTO repack.log_%u(pk, row) "
-		"VALUES(CASE WHEN $1 IS NULL THEN NULL ELSE (ROW(", relid);
-	appendStringInfo(sql, "$1.%s", quote_identifier(trigdata->tg_trigger->tgargs[0]));
-	for (int i = 1; i < trigdata->tg_trigger->tgnargs; ++i)
-		appendStringInfo(sql, ", $1.%s", quote_identifier(trigdata->tg_trigger->tgargs[i]));
-	appendStringInfo(sql, ")::repack.pk_%u) END, $2)", relid);
+	direct_apply_open(&state, relid, pkid);
 
-	/* execute the INSERT query */
-	execute_with_args(SPI_OK_INSERT, sql->data, 2, argtypes, values, nulls);
+	/* the changes of a window of the log, until they are applied */
+	window_context = AllocSetContextCreate(CurrentMemoryContext,
+										   "pg_repack apply window",
+										   ALLOCSET_DEFAULT_SIZES);
 
-	SPI_finish();
+	for (n = 0;;)
+	{
+		int				ntuples;
+		SPITupleTable  *tuptable;
+		DirectChange   *changes;
+		int				nchanges;
+		MemoryContext	oldcontext;
+
+		if (count > 0 && n >= count)
+			break;
+
+		/* peek tuple in log */
+		if (apply_peek(plans, &cursor, count, n) <= 0)
+			break;
+
+		ntuples = SPI_processed;
+		tuptable = SPI_tuptable;
+		if (tuptable->tupdesc->natts - 2 != state.nkeys)
+			elog(ERROR, "pg_repack: unexpected log format");
+
+		oldcontext = MemoryContextSwitchTo(window_context);
+		changes = palloc(sizeof(DirectChange) * ntuples * 2);
+		nchanges = direct_apply_collect(&state, tuptable, ntuples, changes);
+
+		for (int i = 0; i < nchanges; i++)
+		{
+			MemoryContextSwitchTo(GetPerTupleMemoryContext(state.estate));
+			direct_apply_change(&state, &changes[i]);
+
+			/* make the change visible to the next ones */
+			CommandCounterIncrement();
+			ResetPerTupleExprContext(state.estate);
+		}
+		MemoryContextSwitchTo(oldcontext);
+		n += ntuples;
+
+		/* Bulk delete of processed rows from the log table */
+		apply_pop(plans, tuptable, ntuples);
 
-	PG_RETURN_POINTER(tuple);
+		SPI_freetuptable(tuptable);
+		MemoryContextReset(window_context);
+	}
+
+	if (cursor)
+		SPI_cursor_close(cursor);
+	direct_apply_close(&state);
+	MemoryContextDelete(window_context);
+
+	return n;
 }
+#endif   /* PG_VERSION_NUM >= 140000 */
 
 /**
- * @fn      Datum repack_apply(PG_FUNCTION_ARGS)
- * @brief   Apply operations in log table into temp table.
+ * @fn      Datum repack_apply_direct(PG_FUNCTION_ARGS)
+ * @brief   Apply operations in log table into temp table, without SPI.
  *
- * repack_apply(sql_peek, sql_insert, sql_delete, sql_update, sql_pop,  count)
+ * repack_apply_direct(relid, pkid, sql_peek, sql_pop, count)
+ *
+ * Same as repack_apply, but the changes returned by sql_peek are applied to
+ * repack.table_<relid> by the executor directly, the rows being looked up by
+ * their key in repack.index_<pkid>: the table and its indexes are opened once
+ * per call instead of once per change.  An UPDATE of a key which is not in
+ * the table inserts the row, as the key-only log needs.  Unless the table has
+ * other unique indexes, only the last change of each key in a peeked batch is
+ * applied, see direct_apply_collect.  Requires PostgreSQL 14 or later.
  *
+ * @param	relid		OID of the table being repacked.
+ * @param	pkid		OID of its index used as the key of the log.
  * @param	sql_peek	SQL to pop tuple from log table.
- * @param	sql_insert	SQL to insert into temp table.
- * @param	sql_delete	SQL to delete from temp table.
- * @param	sql_update	SQL to update temp table.
- * @param	sql_pop	SQL to bulk-delete tuples from log table.
+ * @param	sql_pop	SQL to bulk-delete tuples from log table, taking their
+ *					ids as a bigint[] $1, or NULL if sql_peek consumes the
+ *					tuples it returns.
  * @param	count		Max number of operations, or no count iff <=0.
  * @retval				Number of performed operations.
  */
 Datum
-repack_apply(PG_FUNCTION_ARGS)
+repack_apply_direct(PG_FUNCTION_ARGS)
 {
-#define DEFAULT_PEEK_COUNT	1000
-
-	const char *sql_peek = PG_GETARG_CSTRING(0);
-	const char *sql_insert = PG_GETARG_CSTRING(1);
-	const char *sql_delete = PG_GETARG_CSTRING(2);
-	const char *sql_update = PG_GETARG_CSTRING(3);
-	/* sql_pop, the fourth arg, will be used in the loop below */
-	int32		count = PG_GETARG_INT32(5);
-
-	SPIPlanPtr		plan_peek = NULL;
-	SPIPlanPtr		plan_insert = NULL;
-	SPIPlanPtr		plan_delete = NULL;
-	SPIPlanPtr		plan_update = NULL;
-	uint32			n, i;
-	Oid				argtypes_peek[1] = { INT4OID };
-	Datum			values_peek[1];
-	const char			nulls_peek[1] = { 0 };
-	StringInfoData		sql_pop;
+#if PG_VERSION_NUM >= 140000
+	ApplyPlans	plans;
+	uint32		n;
 
-	initStringInfo(&sql_pop);
+	memset(&plans, 0, sizeof(plans));
+	plans.sql_peek = PG_GETARG_CSTRING(2);
+	plans.sql_pop = PG_ARGISNULL(3) ? NULL : PG_GETARG_CSTRING(3);
 
 	/* connect to SPI manager */
 	repack_init();
 
-	/* peek tuple in log */
-	plan_peek = repack_prepare(sql_peek, 1, argtypes_peek);
+	n = apply_direct(&plans, PG_GETARG_OID(0), PG_GETARG_OID(1),
+					 PG_GETARG_INT32(4));
 
-	for (n = 0;;)
+	SPI_finish();
+
+	PG_RETURN_INT32(n);
+#else
+	elog(ERROR, "pg_repack: repack_apply_direct requires PostgreSQL 14 or later");
+	PG_RETURN_INT32(0);
+#endif
+}
+
+/*
+ * Statements registered by repack.apply_register(), one set per table being
+ * repacked, with their saved plans.  An entry is marked invalid by a relcache
+ * callback when its log or new table is invalidated; its plans are then
+ * freed and prepared again on next use, and the registration is dropped if
+ * the tables it was made for do not exist any more.
+ */
+typedef struct ApplyPlanEntry
+{
+	Oid			relid;		/* hash key (must be first) */
+	Oid			pkid;		/* index used as the key of the log */
+	Oid			logid;		/* repack.log_<relid> */
+	Oid			tableid;	/* repack.table_<relid> */
+	bool		valid;		/* false if logid or tableid was invalidated */
+	ApplyPlans	plans;		/* statements in TopMemoryContext */
+} ApplyPlanEntry;
+
+static HTAB *apply_plans = NULL;
+
+static void
+apply_plan_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS		status;
+	ApplyPlanEntry	   *entry;
+
+	if (apply_plans == NULL)
+		return;
+
+	hash_seq_init(&status, apply_plans);
+	while ((entry = (ApplyPlanEntry *) hash_seq_search(&status)) != NULL)
 	{
-		int				ntuples;
-		SPITupleTable  *tuptable;
-		TupleDesc		desc;
-		Oid				argtypes[3];	/* id, pk, row */
-		Datum			values[3];		/* id, pk, row */
-		bool			nulls[3];		/* id, pk, row */
+		if (relid == InvalidOid || entry->logid == relid ||
+			entry->tableid == relid)
+			entry->valid = false;
+	}
+}
 
-		/* peek tuple in log */
-		if (count <= 0)
-			values_peek[0] = Int32GetDatum(DEFAULT_PEEK_COUNT);
-		else
-			values_peek[0] = Int32GetDatum(Min(count - n, DEFAULT_PEEK_COUNT));
+static void
+free_apply_plans(ApplyPlans *plans)
+{
+	SPIPlanPtr *saved[4] = { &plans->plan_peek, &plans->plan_insert,
+							 &plans->plan_delete, &plans->plan_pop };
 
-		execute_plan(SPI_OK_SELECT, plan_peek, values_peek, nulls_peek);
-		if (SPI_processed <= 0)
-			break;
+	for (int i = 0; i < lengthof(saved); i++)
+	{
+		if (*saved[i] != NULL)
+			SPI_freeplan(*saved[i]);
+		*saved[i] = NULL;
+	}
+}
 
-		/* copy tuptable because we will call other sqls. */
-		ntuples = SPI_processed;
-		tuptable = SPI_tuptable;
-		desc = tuptable->tupdesc;
-		argtypes[0] = SPI_gettypeid(desc, 1);	/* id */
-		argtypes[1] = SPI_gettypeid(desc, 2);	/* pk */
-		argtypes[2] = SPI_gettypeid(desc, 3);	/* row */
+static void
+remove_apply_plans(ApplyPlanEntry *entry)
+{
+	free_apply_plans(&entry->plans);
+	pfree(entry->plans.sql_peek);
+	pfree(entry->plans.sql_insert);
+	pfree(entry->plans.sql_delete);
+	if (entry->plans.sql_pop)
+		pfree(entry->plans.sql_pop);
+	hash_search(apply_plans, &entry->relid, HASH_REMOVE, NULL);
+}
 
-		resetStringInfo(&sql_pop);
-		appendStringInfoString(&sql_pop, PG_GETARG_CSTRING(4));
+/* the log and the new table of relid, or InvalidOid */
+static void
+get_apply_tables(Oid relid, Oid *logid, Oid *tableid)
+{
+	Oid			nspid = get_namespace_oid("repack", false);
+	char		name[NAMEDATALEN];
 
-		for (i = 0; i < ntuples; i++, n++)
-		{
-			HeapTuple	tuple;
-			char *pkid;
+	snprintf(name, NAMEDATALEN, "log_%u", relid);
+	*logid = get_relname_relid(name, nspid);
+	snprintf(name, NAMEDATALEN, "table_%u", relid);
+	*tableid = get_relname_relid(name, nspid);
+}
 
-			tuple = tuptable->vals[i];
-			values[0] = SPI_getbinval(tuple, desc, 1, &nulls[0]);
-			values[1] = SPI_getbinval(tuple, desc, 2, &nulls[1]);
-			values[2] = SPI_getbinval(tuple, desc, 3, &nulls[2]);
+/**
+ * @fn      Datum repack_apply_register(PG_FUNCTION_ARGS)
+ * @brief   Register the statements applying the log of a table.
+ *
+ * repack_apply_register(relid, pkid, sql_peek, sql_insert, sql_delete, sql_pop)
+ *
+ * The statements are kept by the backend, replacing the ones registered
+ * before for the table, for repack_apply_registered to apply the log without
+ * receiving them, and to prepare them only once.
+ *
+ * @param	relid		OID of the table being repacked.
+ * @param	pkid		OID of its index used as the key of the log.
+ * @param	sql_peek	SQL to peek the changes, see repack_apply.
+ * @param	sql_insert	SQL to insert into temp table, see repack_apply_batch.
+ * @param	sql_delete	SQL to delete from temp table, see repack_apply_batch.
+ * @param	sql_pop	SQL to bulk-delete tuples from log table, or NULL if
+ *					sql_peek consumes the tuples it returns.
+ * @retval	None
+ */
+Datum
+repack_apply_register(PG_FUNCTION_ARGS)
+{
+	Oid				relid;
+	Oid				logid;
+	Oid				tableid;
+	ApplyPlanEntry *entry;
+	bool			found;
 
-			pkid = SPI_getvalue(tuple, desc, 1);
-			Assert(pkid != NULL);
+	for (int i = 0; i < 5; i++)
+	{
+		if (PG_ARGISNULL(i))
+			elog(ERROR, "repack_apply_register: only sql_pop may be NULL");
+	}
+	relid = PG_GETARG_OID(0);
 
-			if (nulls[1])
-			{
-				/* INSERT */
-				if (plan_insert == NULL)
-					plan_insert = repack_prepare(sql_insert, 1, &argtypes[2]);
-				execute_plan(SPI_OK_INSERT, plan_insert, &values[2], (nulls[2] ? "n" : " "));
-			}
-			else if (nulls[2])
-			{
-				/* DELETE */
-				if (plan_delete == NULL)
-					plan_delete = repack_prepare(sql_delete, 1, &argtypes[1]);
-				execute_plan(SPI_OK_DELETE, plan_delete, &values[1], (nulls[1] ? "n" : " "));
-			}
-			else
-			{
-				/* UPDATE */
-				if (plan_update == NULL)
-					plan_update = repack_prepare(sql_update, 2, &argtypes[1]);
-				execute_plan(SPI_OK_UPDATE, plan_update, &values[1], (nulls[1] ? "n" : " "));
-			}
+	get_apply_tables(relid, &logid, &tableid);
+	if (!OidIsValid(logid) || !OidIsValid(tableid))
+		elog(ERROR, "pg_repack: repack.log_%u or repack.table_%u not found",
+			 relid, relid);
 
-			/* Add the primary key ID of each row from the log
-			 * table we have processed so far to this
-			 * DELETE ... IN (...) query string, so we
-			 * can delete all the rows we have processed at-once.
-			 */
-			if (i == 0)
-				appendStringInfoString(&sql_pop, pkid);
-			else
-				appendStringInfo(&sql_pop, ",%s", pkid);
-			pfree(pkid);
-		}
-		/* i must be > 0 (and hence we must have some rows to delete)
-		 * since SPI_processed > 0
-		 */
-		Assert(i > 0);
-		appendStringInfoString(&sql_pop, ");");
+	if (apply_plans == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(ApplyPlanEntry);
+		apply_plans = hash_create("pg_repack apply plans", 16, &ctl,
+								  HASH_ELEM | HASH_BLOBS);
+		CacheRegisterRelcacheCallback(apply_plan_invalidate, (Datum) 0);
+	}
 
-		/* Bulk delete of processed rows from the log table */
-		execute(SPI_OK_DELETE, sql_pop.data);
+	entry = (ApplyPlanEntry *) hash_search(apply_plans, &relid, HASH_FIND, NULL);
+	if (entry != NULL)
+		remove_apply_plans(entry);
+	entry = (ApplyPlanEntry *) hash_search(apply_plans, &relid, HASH_ENTER, &found);
+
+	entry->pkid = PG_GETARG_OID(1);
+	entry->logid = logid;
+	entry->tableid = tableid;
+	entry->valid = true;
+	memset(&entry->plans, 0, sizeof(ApplyPlans));
+	entry->plans.sql_peek = MemoryContextStrdup(TopMemoryContext,
+												text_to_cstring(PG_GETARG_TEXT_PP(2)));
+	entry->plans.sql_insert = MemoryContextStrdup(TopMemoryContext,
+												  text_to_cstring(PG_GETARG_TEXT_PP(3)));
+	entry->plans.sql_delete = MemoryContextStrdup(TopMemoryContext,
+												  text_to_cstring(PG_GETARG_TEXT_PP(4)));
+	if (!PG_ARGISNULL(5))
+		entry->plans.sql_pop = MemoryContextStrdup(TopMemoryContext,
+												   text_to_cstring(PG_GETARG_TEXT_PP(5)));
+	entry->plans.keep = true;
 
-		SPI_freetuptable(tuptable);
+	PG_RETURN_VOID();
+}
+
+/**
+ * @fn      Datum repack_apply_registered(PG_FUNCTION_ARGS)
+ * @brief   Apply the log of a table with the statements registered for it.
+ *
+ * repack_apply_registered(relid, count)
+ *
+ * Same as repack_apply_direct, or repack_apply_batch before PostgreSQL 14,
+ * with the statements registered by repack_apply_register, whose plans are
+ * kept from one call to the next.
+ *
+ * @param	relid		OID of the table being repacked.
+ * @param	count		Max number of operations, or no count iff <=0.
+ * @retval				Number of performed operations.
+ */
+Datum
+repack_apply_registered(PG_FUNCTION_ARGS)
+{
+	Oid				relid = PG_GETARG_OID(0);
+	int32			count = PG_GETARG_INT32(1);
+	ApplyPlanEntry *entry = NULL;
+	uint32			n;
+
+	if (apply_plans != NULL)
+		entry = (ApplyPlanEntry *) hash_search(apply_plans, &relid, HASH_FIND, NULL);
+	if (entry == NULL)
+		elog(ERROR, "pg_repack: no apply registered for table %u", relid);
+
+	if (!entry->valid)
+	{
+		Oid		logid;
+		Oid		tableid;
+
+		free_apply_plans(&entry->plans);
+		get_apply_tables(relid, &logid, &tableid);
+		if (logid != entry->logid || tableid != entry->tableid)
+		{
+			remove_apply_plans(entry);
+			elog(ERROR, "pg_repack: no apply registered for table %u", relid);
+		}
+		entry->valid = true;
 	}
 
+	/* connect to SPI manager */
+	repack_init();
+
+#if PG_VERSION_NUM >= 140000
+	n = apply_direct(&entry->plans, relid, entry->pkid, count);
+#else
+	n = apply_batch(&entry->plans, count);
+#endif
+
 	SPI_finish();
 
 	PG_RETURN_INT32(n);
@@ -1029,11 +2688,8 @@ repack_swap(PG_FUNCTION_ARGS)
 		CommandCounterIncrement();
 	}
 
-	/* drop repack trigger */
-	execute_with_format(
-		SPI_OK_UTILITY,
-		"DROP TRIGGER IF EXISTS repack_trigger ON %s.%s CASCADE",
-		nspname, relname);
+	/* drop repack triggers */
+	drop_repack_triggers(oid, nspname, relname);
 
 	SPI_finish();
 
@@ -1080,7 +2736,7 @@ repack_drop(PG_FUNCTION_ARGS)
 		execute_with_args(SPI_OK_SELECT,
 			"SELECT tgname"
 			"  FROM pg_trigger"
-			" WHERE tgrelid = $1 AND tgname = 'repack_trigger'",
+			" WHERE tgrelid = $1 AND tgname IN (" REPACK_TRIGGER_NAMES ")",
 			1, argtypes, values, nulls);
 
 		trigger_exists = SPI_processed > 0;
@@ -1113,40 +2769,24 @@ repack_drop(PG_FUNCTION_ARGS)
 			nspname, relname);
 	}
 
-	/* drop log table: must be done before dropping the pk type,
-	 * since the log table is dependent on the pk type. (That's
-	 * why we check numobj > 1 here.)
-	 */
-	if (numobj > 1)
-	{
-		execute_with_format(
-			SPI_OK_UTILITY,
-			"DROP TABLE IF EXISTS repack.log_%u CASCADE",
-			oid);
-		--numobj;
-	}
-
-	/* drop type for pk type */
+	/* drop log table */
 	if (numobj > 0)
 	{
 		execute_with_format(
 			SPI_OK_UTILITY,
-			"DROP TYPE IF EXISTS repack.pk_%u",
+			"DROP TABLE IF EXISTS repack.log_%u CASCADE",
 			oid);
 		--numobj;
 	}
 
 	/*
-	 * drop repack trigger: We have already dropped the trigger in normal
-	 * cases, but it can be left on error.
+	 * drop repack triggers: We have already dropped the triggers in normal
+	 * cases, but they can be left on error.
 	 */
 	if (numobj > 0)
 	{
 		if (trigger_exists)
-			execute_with_format(
-				SPI_OK_UTILITY,
-				"DROP TRIGGER IF EXISTS repack_trigger ON %s.%s CASCADE",
-				nspname, relname);
+			drop_repack_triggers(oid, nspname, relname);
 		--numobj;
 	}
 
@@ -1160,23 +2800,71 @@ repack_drop(PG_FUNCTION_ARGS)
 		--numobj;
 	}
 
+#if PG_VERSION_NUM >= 100000
+	/*
+	 * drop the replication slot used by --capture=logical, if any. It is a
+	 * temporary slot, so only this session may own it.
+	 */
+	execute_with_format(
+		SPI_OK_SELECT,
+		"SELECT pg_catalog.pg_drop_replication_slot(slot_name)"
+		"  FROM pg_catalog.pg_replication_slots"
+		" WHERE slot_name = 'repack_%u_' || pg_catalog.pg_backend_pid()"
+		"   AND active_pid = pg_catalog.pg_backend_pid()",
+		oid);
+#endif
+
+	/* release the shared memory ring used by --capture=ring, if any */
+	repack_ring_unregister(oid);
+
 	SPI_finish();
 
 	PG_RETURN_VOID();
 }
 
+/**
+ * @fn      Datum repack_flush_wal(PG_FUNCTION_ARGS)
+ * @brief   Flush the WAL written so far to disk.
+ *
+ * repack_flush_wal()
+ *
+ * Logical decoding only reads flushed WAL: used with --capture=logical,
+ * once the table is locked, so that the changes of asynchronously committed
+ * transactions are decoded before the swap.
+ *
+ * @retval			None.
+ */
+Datum
+repack_flush_wal(PG_FUNCTION_ARGS)
+{
+	XLogFlush(GetXLogInsertRecPtr());
+
+	PG_RETURN_VOID();
+}
+
 Datum
 repack_disable_autovacuum(PG_FUNCTION_ARGS)
 {
 	Oid			oid = PG_GETARG_OID(0);
+	List	   *relids = list_make1_oid(oid);
+	ListCell   *cell;
+
+#if PG_VERSION_NUM >= 100000
+	/* a segmented log has no storage itself, disable it on the segments */
+	if (get_rel_relkind(oid) == RELKIND_PARTITIONED_TABLE)
+		relids = find_inheritance_children(oid, NoLock);
+#endif
 
 	/* connect to SPI manager */
 	repack_init();
 
-	execute_with_format(
-		SPI_OK_UTILITY,
-		"ALTER TABLE %s SET (autovacuum_enabled = off)",
-		get_relation_name(oid));
+	foreach(cell, relids)
+	{
+		execute_with_format(
+			SPI_OK_UTILITY,
+			"ALTER TABLE %s SET (autovacuum_enabled = off)",
+			get_relation_name(lfirst_oid(cell)));
+	}
 
 	SPI_finish();
 
@@ -1216,6 +2904,35 @@ get_quoted_nspname(Oid oid)
 	return (nspname ? quote_identifier(nspname) : NULL);
 }
 
+/* drop whichever of the repack triggers exist on the table */
+static void
+drop_repack_triggers(Oid relid, const char *nspname, const char *relname)
+{
+	Oid			argtypes[1] = { OIDOID };
+	bool		nulls[1] = { 0 };
+	Datum		values[1];
+	uint64		ntriggers;
+	char	  **tgnames;
+
+	values[0] = ObjectIdGetDatum(relid);
+	execute_with_args(SPI_OK_SELECT,
+		"SELECT tgname"
+		"  FROM pg_trigger"
+		" WHERE tgrelid = $1 AND tgname IN (" REPACK_TRIGGER_NAMES ")",
+		1, argtypes, values, nulls);
+
+	ntriggers = SPI_processed;
+	tgnames = palloc(sizeof(char *) * (ntriggers + 1));
+	for (uint64 i = 0; i < ntriggers; i++)
+		tgnames[i] = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+
+	for (uint64 i = 0; i < ntriggers; i++)
+		execute_with_format(
+			SPI_OK_UTILITY,
+			"DROP TRIGGER IF EXISTS %s ON %s.%s CASCADE",
+			quote_identifier(tgnames[i]), nspname, relname);
+}
+
 /*
  * This is a copy of swap_relation_files in cluster.c, but it also swaps
  * relfrozenxid.
@@ -0,0 +1,368 @@
+/*
+ * pg_repack: lib/repack_decode.c
+ *
+ * Logical decoding output plugin used by pg_repack --capture=logical.
+ *
+ * The plugin decodes the changes of a single table and outputs each of them
+ * as the text representation of a row of the log table, repack.log_<oid>
+ * (id, key1, ..., keyN, row), so that repack_apply can replay them exactly as
+ * it replays the rows written by repack_trigger.  The id is the LSN of the
+ * change.
+ *
+ * Options:
+ *	relid		OID of the table being repacked (mandatory).
+ *	pkid		OID of its index whose columns are logged as keys (mandatory).
+ *	snapshot	txid_current_snapshot() of the transaction which copied the
+ *				table.  Transactions visible to it are already in the copy
+ *				and are skipped.
+ *
+ * Portions Copyright (c) 2012-2020, The Reorg Development Team
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/transam.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_index.h"
+#include "commands/defrem.h"
+#include "replication/logical.h"
+#include "replication/output_plugin.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+#include "utils/typcache.h"
+
+#include "pgut/pgut-be.h"
+
+/* Logical decoding with temporary slots is used from PostgreSQL 10 only */
+#if PG_VERSION_NUM >= 100000
+
+/*
+ * varlena macros were moved out of postgres.h in 16.0
+ */
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+/*
+ * ReorderBufferTupleBuf was removed in 17.0, changes carry a HeapTuple
+ */
+#if PG_VERSION_NUM >= 170000
+#define CHANGE_TUPLE(tup)	(tup)
+#else
+#define CHANGE_TUPLE(tup)	((tup) ? &(tup)->tuple : NULL)
+#endif
+
+typedef struct RepackDecodingData
+{
+	MemoryContext	context;	/* reset after each change */
+	Oid				relid;		/* table being repacked */
+	Oid				pkid;		/* index giving the key columns */
+
+	/* copy snapshot, converted to 32-bit xids */
+	bool			has_snapshot;
+	TransactionId	xmin;
+	TransactionId	xmax;
+	int				nxip;
+	TransactionId  *xip;
+
+	/* looked up on the first change */
+	Oid				logtypid;	/* row type of repack.log_<relid> */
+	int				nkeys;		/* number of key columns */
+	AttrNumber	   *keys;		/* attnums of the key columns in relid */
+	Oid				typoutput;	/* output function of logtypid */
+} RepackDecodingData;
+
+extern void PGUT_EXPORT _PG_output_plugin_init(OutputPluginCallbacks *cb);
+
+static void repack_decode_startup(LogicalDecodingContext *ctx,
+								  OutputPluginOptions *opt, bool is_init);
+static void repack_decode_shutdown(LogicalDecodingContext *ctx);
+static void repack_decode_begin(LogicalDecodingContext *ctx,
+								ReorderBufferTXN *txn);
+static void repack_decode_commit(LogicalDecodingContext *ctx,
+								 ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
+static void repack_decode_change(LogicalDecodingContext *ctx,
+								 ReorderBufferTXN *txn, Relation relation,
+								 ReorderBufferChange *change);
+
+void
+_PG_output_plugin_init(OutputPluginCallbacks *cb)
+{
+	cb->startup_cb = repack_decode_startup;
+	cb->begin_cb = repack_decode_begin;
+	cb->change_cb = repack_decode_change;
+	cb->commit_cb = repack_decode_commit;
+	cb->shutdown_cb = repack_decode_shutdown;
+}
+
+/* parse a txid_snapshot text, "xmin:xmax:xip1,xip2,..." */
+static void
+parse_snapshot(RepackDecodingData *data, const char *str)
+{
+	char	   *end;
+	int			n;
+
+	data->xmin = (TransactionId) strtoull(str, &end, 10);
+	if (*end != ':')
+		goto bad_format;
+	data->xmax = (TransactionId) strtoull(end + 1, &end, 10);
+	if (*end != ':')
+		goto bad_format;
+
+	/* count the in-progress xids */
+	n = (end[1] != '\0') ? 1 : 0;
+	for (const char *c = end + 1; *c; c++)
+		if (*c == ',')
+			n++;
+
+	data->xip = palloc(sizeof(TransactionId) * Max(n, 1));
+	data->nxip = 0;
+	while (data->nxip < n)
+	{
+		data->xip[data->nxip++] = (TransactionId) strtoull(end + 1, &end, 10);
+		if (*end != ',' && *end != '\0')
+			goto bad_format;
+	}
+
+	data->has_snapshot = true;
+	return;
+
+bad_format:
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid snapshot \"%s\"", str)));
+}
+
+static void
+repack_decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
+					  bool is_init)
+{
+	RepackDecodingData *data;
+	ListCell   *option;
+
+	data = palloc0(sizeof(RepackDecodingData));
+	data->context = AllocSetContextCreate(ctx->context,
+										  "pg_repack decoding context",
+										  ALLOCSET_DEFAULT_SIZES);
+	ctx->output_plugin_private = data;
+	opt->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+
+	foreach(option, ctx->output_plugin_options)
+	{
+		DefElem    *elem = lfirst(option);
+
+		if (strcmp(elem->defname, "relid") == 0)
+			data->relid = (Oid) strtoul(defGetString(elem), NULL, 10);
+		else if (strcmp(elem->defname, "pkid") == 0)
+			data->pkid = (Oid) strtoul(defGetString(elem), NULL, 10);
+		else if (strcmp(elem->defname, "snapshot") == 0)
+			parse_snapshot(data, defGetString(elem));
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" = \"%s\" is unknown",
+							elem->defname,
+							elem->arg ? strVal(elem->arg) : "(null)")));
+	}
+
+	/* the slot is created without options */
+	if (!is_init && !OidIsValid(data->relid))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"relid\" is required")));
+	if (!is_init && !OidIsValid(data->pkid))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"pkid\" is required")));
+}
+
+static void
+repack_decode_shutdown(LogicalDecodingContext *ctx)
+{
+	RepackDecodingData *data = ctx->output_plugin_private;
+
+	MemoryContextDelete(data->context);
+}
+
+static void
+repack_decode_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	/* nothing to do, only changes are output */
+}
+
+static void
+repack_decode_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					 XLogRecPtr commit_lsn)
+{
+	/* nothing to do, only changes are output */
+}
+
+/* true if the transaction was already committed for the copy snapshot */
+static bool
+visible_in_snapshot(RepackDecodingData *data, TransactionId xid)
+{
+	if (!data->has_snapshot)
+		return false;
+	if (TransactionIdPrecedes(xid, data->xmin))
+		return true;
+	if (!TransactionIdPrecedes(xid, data->xmax))
+		return false;
+	for (int i = 0; i < data->nxip; i++)
+	{
+		if (TransactionIdEquals(xid, data->xip[i]))
+			return false;
+	}
+	return true;
+}
+
+/* look up the log type and the key columns of the table, on the first change */
+static void
+lookup_log_types(LogicalDecodingContext *ctx, RepackDecodingData *data)
+{
+	char			logname[NAMEDATALEN];
+	Oid				logrelid;
+	HeapTuple		indtuple;
+	Form_pg_index	index;
+	bool			typisvarlena;
+
+	snprintf(logname, NAMEDATALEN, "log_%u", data->relid);
+	logrelid = get_relname_relid(logname, get_namespace_oid("repack", false));
+	if (!OidIsValid(logrelid))
+		elog(ERROR, "pg_repack: log table repack.%s not found", logname);
+
+	data->logtypid = get_rel_type_id(logrelid);
+	getTypeOutputInfo(data->logtypid, &data->typoutput, &typisvarlena);
+
+	/* the key columns of the log are the columns of the index, in order */
+	indtuple = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(data->pkid));
+	if (!HeapTupleIsValid(indtuple))
+		elog(ERROR, "pg_repack: cache lookup failed for index %u", data->pkid);
+	index = (Form_pg_index) GETSTRUCT(indtuple);
+	data->nkeys = index->indnatts;
+	data->keys = MemoryContextAlloc(ctx->context,
+									sizeof(AttrNumber) * index->indnatts);
+	for (int i = 0; i < index->indnatts; i++)
+		data->keys[i] = index->indkey.values[i];
+	ReleaseSysCache(indtuple);
+}
+
+/* set the key columns of a log row from the keys of tuple */
+static void
+form_keys(RepackDecodingData *data, HeapTuple tuple, TupleDesc desc,
+		  Datum *values, bool *nulls)
+{
+	for (int i = 0; i < data->nkeys; i++)
+		values[i] = heap_getattr(tuple, data->keys[i], desc, &nulls[i]);
+}
+
+/*
+ * Build a composite of the table row type from a new tuple.  The values of
+ * TOASTed columns which were not changed by an UPDATE are not in the WAL:
+ * take them from the old tuple, which REPLICA IDENTITY FULL logs flattened.
+ */
+static Datum
+form_row(HeapTuple newtuple, HeapTuple oldtuple, TupleDesc desc)
+{
+	Datum	   *values = palloc(sizeof(Datum) * desc->natts);
+	bool	   *nulls = palloc(sizeof(bool) * desc->natts);
+
+	heap_deform_tuple(newtuple, desc, values, nulls);
+
+	for (int i = 0; i < desc->natts; i++)
+	{
+#if PG_VERSION_NUM >= 110000
+		Form_pg_attribute attr = TupleDescAttr(desc, i);
+#else
+		Form_pg_attribute attr = desc->attrs[i];
+#endif
+
+		if (attr->attisdropped || attr->attlen != -1 || nulls[i] ||
+			!VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(values[i])))
+			continue;
+
+		if (oldtuple == NULL)
+			elog(ERROR, "pg_repack: unchanged TOAST value of column \"%s\" is not available",
+				 NameStr(attr->attname));
+		values[i] = heap_getattr(oldtuple, i + 1, desc, &nulls[i]);
+	}
+
+	return heap_copy_tuple_as_datum(heap_form_tuple(desc, values, nulls), desc);
+}
+
+static void
+repack_decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					 Relation relation, ReorderBufferChange *change)
+{
+	RepackDecodingData *data = ctx->output_plugin_private;
+	TupleDesc		desc = RelationGetDescr(relation);
+	HeapTuple		oldtuple;
+	HeapTuple		newtuple;
+	TupleDesc		logdesc;
+	Datum		   *values;		/* id, keys, row */
+	bool		   *nulls;
+	int				nkeys;
+	MemoryContext	old_context;
+
+	if (RelationGetRelid(relation) != data->relid ||
+		visible_in_snapshot(data, txn->xid))
+		return;
+
+	old_context = MemoryContextSwitchTo(data->context);
+
+	if (!OidIsValid(data->logtypid))
+		lookup_log_types(ctx, data);
+
+	oldtuple = CHANGE_TUPLE(change->data.tp.oldtuple);
+	newtuple = CHANGE_TUPLE(change->data.tp.newtuple);
+
+	nkeys = data->nkeys;
+	values = palloc(sizeof(Datum) * (nkeys + 2));
+	nulls = palloc0(sizeof(bool) * (nkeys + 2));
+	values[0] = Int64GetDatum((int64) change->lsn);
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			/* INSERT: (NULL, newtup) */
+			for (int i = 1; i <= nkeys; i++)
+				nulls[i] = true;
+			values[nkeys + 1] = form_row(newtuple, NULL, desc);
+			break;
+
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			/* UPDATE: (oldtup, newtup), no old tuple if the key is unchanged */
+			form_keys(data, oldtuple ? oldtuple : newtuple, desc,
+					  values + 1, nulls + 1);
+			values[nkeys + 1] = form_row(newtuple, oldtuple, desc);
+			break;
+
+		case REORDER_BUFFER_CHANGE_DELETE:
+			/* DELETE: (oldtup, NULL) */
+			if (oldtuple == NULL)
+				elog(ERROR, "pg_repack: old key of a deleted row is not available");
+			form_keys(data, oldtuple, desc, values + 1, nulls + 1);
+			nulls[nkeys + 1] = true;
+			break;
+
+		default:
+			MemoryContextSwitchTo(old_context);
+			return;
+	}
+
+	logdesc = lookup_rowtype_tupdesc(data->logtypid, -1);
+	OutputPluginPrepareWrite(ctx, true);
+	appendStringInfoString(ctx->out,
+		OidOutputFunctionCall(data->typoutput,
+			heap_copy_tuple_as_datum(heap_form_tuple(logdesc, values, nulls),
+									 logdesc)));
+	OutputPluginWrite(ctx, true);
+	ReleaseTupleDesc(logdesc);
+
+	MemoryContextSwitchTo(old_context);
+	MemoryContextReset(data->context);
+}
+
+#endif   /* PG_VERSION_NUM >= 100000 */
@@ -0,0 +1,893 @@
+/*
+ * pg_repack: lib/repack_ring.c
+ *
+ * Shared memory change capture used by pg_repack --capture=ring.
+ *
+ * When pg_repack is listed in shared_preload_libraries, a fixed number of
+ * tables can be registered with repack.ring_register().  repack_trigger then
+ * appends the changes of a registered table to a ring buffer in shared
+ * memory instead of inserting them into the log table, which saves the SPI
+ * call and the heap and WAL traffic of the log.  repack.ring_peek() returns
+ * and consumes the changes of committed transactions in the order they were
+ * made, as rows of the log table, so that repack_apply can replay them.
+ *
+ * The ring is not transactional: each record carries the xid which wrote it,
+ * records of aborted transactions are skipped and records of transactions
+ * still in progress are kept until they finish.  When the ring of a table is
+ * full, the table is marked as spilled and every later change goes to the
+ * log table, which must be applied after the ring.
+ *
+ * The rings are off unless pg_repack.ring_size is set.  Each table has its
+ * own lock, so the writers of different tables don't wait for each other;
+ * the global lock only protects the assignment of the tables to the rings.
+ *
+ * The shared memory also holds the counter numbering the rows of the log
+ * tables, see repack.next_log_id().
+ *
+ * Portions Copyright (c) 2012-2020, The Reorg Development Team
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/subtrans.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "commands/sequence.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/tuplestore.h"
+
+#include "pgut/pgut-be.h"
+
+#include "repack_ring.h"
+
+/* number of tables which may be captured at the same time */
+#define RING_MAX_TABLES		8
+
+typedef struct RingTable
+{
+	LWLock	   *lock;		/* protects the fields below and the buffer */
+	Oid			dboid;		/* database of the registered table */
+	Oid			relid;		/* registered table, or InvalidOid if free */
+	Oid			logrelid;	/* its repack.log_<relid> when registered */
+	int			owner;		/* pid of the backend which registered it */
+	bool		spilled;	/* the ring overflowed, use the log table */
+	uint64		head;		/* position of the next record */
+	uint64		tail;		/* position of the oldest unconsumed record */
+	int64		next_id;	/* id of the next record */
+	int64		pending;	/* records not consumed yet */
+} RingTable;
+
+typedef struct RingShared
+{
+	LWLock	   *lock;		/* protects the assignment of the tables */
+	Size		size;		/* size of the buffer of each table */
+	pg_atomic_uint64 log_id;	/* last id given to a row of a log table */
+	RingTable	tables[RING_MAX_TABLES];
+	/* followed by the buffers of the tables */
+} RingShared;
+
+/*
+ * A change as stored in the ring, followed by the pk and the row images,
+ * both MAXALIGN'ed.  Records never wrap around the end of the buffer: a
+ * record of length 0 means the next one is at the start of the buffer.
+ */
+typedef struct RingRecord
+{
+	uint32		len;		/* MAXALIGN'ed length of the record, or 0 */
+	bool		consumed;	/* already returned or discarded */
+	TransactionId xid;		/* transaction which made the change */
+	int64		id;			/* order of the change in the ring */
+	uint32		pklen;		/* length of the key image, 0 if NULL */
+	uint32		rowlen;		/* length of the row image, 0 if NULL */
+} RingRecord;
+
+#define RING_RECORD_DATA(rec)	((char *) (rec) + MAXALIGN(sizeof(RingRecord)))
+
+/*
+ * Log table and key columns of a table, cached per backend by the writers
+ * and forgotten on relcache invalidation.
+ */
+typedef struct RingKeyEntry
+{
+	Oid			relid;		/* hash key (must be first) */
+	bool		valid;
+	Oid			logrelid;	/* repack.log_<relid> */
+	TupleDesc	keydesc;	/* descriptor of the key image */
+	int			nkeys;
+	AttrNumber	keys[INDEX_MAX_KEYS];
+} RingKeyEntry;
+
+extern Datum PGUT_EXPORT repack_ring_register(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_ring_discard(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_ring_peek(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_next_log_id(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT repack_ring_pending(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(repack_ring_register);
+PG_FUNCTION_INFO_V1(repack_ring_discard);
+PG_FUNCTION_INFO_V1(repack_ring_peek);
+PG_FUNCTION_INFO_V1(repack_next_log_id);
+PG_FUNCTION_INFO_V1(repack_ring_pending);
+
+/* size of the buffer of each table, in kB, or 0 to disable the rings */
+static int	ring_size = 0;
+
+static RingShared *ring = NULL;
+static HTAB *ring_keys = NULL;
+
+/* sequences of the log tables whose ids this backend has seeded the counter with */
+static HTAB *seeded_logs = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size
+ring_memsize(void)
+{
+	return add_size(MAXALIGN(sizeof(RingShared)),
+					mul_size(RING_MAX_TABLES, (Size) ring_size * 1024));
+}
+
+static void
+ring_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(ring_memsize());
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("pg_repack", RING_MAX_TABLES + 1);
+#else
+	RequestAddinLWLocks(RING_MAX_TABLES + 1);
+#endif
+}
+
+static void
+ring_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	ring = ShmemInitStruct("pg_repack ring", ring_memsize(), &found);
+	if (!found)
+	{
+#if PG_VERSION_NUM >= 90600
+		LWLockPadded *locks = GetNamedLWLockTranche("pg_repack");
+#endif
+
+		memset(ring, 0, sizeof(RingShared));
+#if PG_VERSION_NUM >= 90600
+		ring->lock = &locks[0].lock;
+		for (int i = 0; i < RING_MAX_TABLES; i++)
+			ring->tables[i].lock = &locks[i + 1].lock;
+#else
+		ring->lock = LWLockAssign();
+		for (int i = 0; i < RING_MAX_TABLES; i++)
+			ring->tables[i].lock = LWLockAssign();
+#endif
+		ring->size = (Size) ring_size * 1024;
+		pg_atomic_init_u64(&ring->log_id, 0);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* called by _PG_init when the library is preloaded */
+void
+repack_ring_init(void)
+{
+	DefineCustomIntVariable("pg_repack.ring_size",
+							"Size of the shared memory change ring of each table being repacked.",
+							"0 disables the rings.",
+							&ring_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = ring_shmem_request;
+#else
+	ring_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = ring_shmem_startup;
+}
+
+/*
+ * The registered table of relid in the current database, or a free ring if
+ * relid is InvalidOid, or NULL. The OIDs of tables are only unique within a
+ * database. Must hold ring->lock.
+ */
+static RingTable *
+ring_find_table(Oid relid)
+{
+	for (int i = 0; i < RING_MAX_TABLES; i++)
+	{
+		if (ring->tables[i].relid == relid &&
+			(!OidIsValid(relid) || ring->tables[i].dboid == MyDatabaseId))
+			return &ring->tables[i];
+	}
+	return NULL;
+}
+
+/* the registered table of relid, locked exclusively */
+static RingTable *
+ring_lock_table(Oid relid)
+{
+	RingTable  *table;
+
+	LWLockAcquire(ring->lock, LW_SHARED);
+	table = ring_find_table(relid);
+	if (table == NULL)
+		elog(ERROR, "table %u is not registered for shared memory capture", relid);
+	LWLockAcquire(table->lock, LW_EXCLUSIVE);
+	LWLockRelease(ring->lock);
+
+	return table;
+}
+
+/*
+ * A ring to register a table with: a free one, or one left registered by a
+ * backend which is gone, such as the connection of an interrupted run, in
+ * whichever database. Must hold ring->lock exclusively.
+ */
+static RingTable *
+ring_free_table(void)
+{
+	RingTable  *table = ring_find_table(InvalidOid);
+
+	for (int i = 0; table == NULL && i < RING_MAX_TABLES; i++)
+	{
+		if (BackendPidGetProc(ring->tables[i].owner) == NULL)
+			table = &ring->tables[i];
+	}
+	return table;
+}
+
+static RingRecord *
+ring_record(RingTable *table, uint64 pos)
+{
+	char	   *buffers = (char *) ring + MAXALIGN(sizeof(RingShared));
+
+	return (RingRecord *) (buffers + (table - ring->tables) * ring->size +
+						   pos % ring->size);
+}
+
+/* position of the record following the one at pos */
+static uint64
+ring_next(RingTable *table, uint64 pos)
+{
+	RingRecord *rec = ring_record(table, pos);
+
+	if (rec->len == 0)
+		return pos + ring->size - pos % ring->size;
+	return pos + rec->len;
+}
+
+/* true if the transaction had committed when the snapshot was taken */
+static bool
+committed_in_snapshot(TransactionId xid, Snapshot snapshot)
+{
+	if (TransactionIdFollowsOrEquals(xid, snapshot->xmax))
+		return false;
+	if (TransactionIdFollowsOrEquals(xid, snapshot->xmin))
+	{
+		TransactionId	top = SubTransGetTopmostTransaction(xid);
+
+		for (uint32 i = 0; i < snapshot->xcnt; i++)
+		{
+			if (TransactionIdEquals(top, snapshot->xip[i]))
+				return false;
+		}
+	}
+	return TransactionIdDidCommit(xid);
+}
+
+static void
+ring_key_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS		status;
+	RingKeyEntry	   *entry;
+
+	hash_seq_init(&status, ring_keys);
+	while ((entry = (RingKeyEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (relid == InvalidOid || entry->relid == relid)
+			entry->valid = false;
+	}
+}
+
+/*
+ * Descriptor of the key image of a change, made of natts attributes of desc
+ * starting at attno.  The image has the layout of a tuple of the key columns
+ * of the log table, so the writers and ring_peek build the same descriptor
+ * from the table and from the log table.
+ */
+static TupleDesc
+ring_key_desc(TupleDesc desc, AttrNumber *attnos, int natts)
+{
+#if PG_VERSION_NUM >= 120000
+	TupleDesc	keydesc = CreateTemplateTupleDesc(natts);
+#else
+	TupleDesc	keydesc = CreateTemplateTupleDesc(natts, false);
+#endif
+
+	for (int i = 0; i < natts; i++)
+		TupleDescCopyEntry(keydesc, i + 1, desc, attnos[i]);
+
+	return keydesc;
+}
+
+/*
+ * Look up the log table and the key columns named by the trigger.  The log table identifies the run of pg_repack: a ring left
+ * registered by an interrupted run must not capture the changes of a later
+ * run which doesn't use it.
+ */
+static RingKeyEntry *
+ring_get_keys(TriggerData *trigdata)
+{
+	Relation		rel = trigdata->tg_relation;
+	Oid				relid = RelationGetRelid(rel);
+	Trigger		   *trigger = trigdata->tg_trigger;
+	RingKeyEntry   *entry;
+	bool			found;
+	Oid				nspid;
+	char			name[NAMEDATALEN];
+	MemoryContext	oldcontext;
+
+	if (ring_keys == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(RingKeyEntry);
+		ring_keys = hash_create("pg_repack ring keys", 16, &ctl,
+								HASH_ELEM | HASH_BLOBS);
+		CacheRegisterRelcacheCallback(ring_key_invalidate, (Datum) 0);
+	}
+
+	entry = (RingKeyEntry *) hash_search(ring_keys, &relid, HASH_ENTER, &found);
+	if (found && entry->valid)
+		return entry;
+	if (found && entry->keydesc)
+		FreeTupleDesc(entry->keydesc);
+	entry->keydesc = NULL;
+	entry->valid = false;
+
+	nspid = get_namespace_oid("repack", false);
+	snprintf(name, NAMEDATALEN, "log_%u", relid);
+	entry->logrelid = get_relname_relid(name, nspid);
+	if (!OidIsValid(entry->logrelid))
+		elog(ERROR, "pg_repack: table repack.%s not found", name);
+
+	if (trigger->tgnargs > INDEX_MAX_KEYS)
+		elog(ERROR, "repack_trigger: too many key columns");
+	entry->nkeys = trigger->tgnargs;
+	for (int i = 0; i < trigger->tgnargs; i++)
+	{
+		entry->keys[i] = SPI_fnumber(RelationGetDescr(rel), trigger->tgargs[i]);
+		if (entry->keys[i] <= 0)
+			elog(ERROR, "repack_trigger: column \"%s\" not found",
+				 trigger->tgargs[i]);
+	}
+	oldcontext = MemoryContextSwitchTo(CacheMemoryContext);
+	entry->keydesc = ring_key_desc(RelationGetDescr(rel), entry->keys,
+								   entry->nkeys);
+	MemoryContextSwitchTo(oldcontext);
+	entry->valid = true;
+
+	return entry;
+}
+
+/* image of the key columns of tuple, with TOASTed values inlined */
+static HeapTupleHeader
+ring_form_pk(TriggerData *trigdata, RingKeyEntry *keys, HeapTuple tuple)
+{
+	TupleDesc		desc = RelationGetDescr(trigdata->tg_relation);
+	Datum			values[INDEX_MAX_KEYS];
+	bool			nulls[INDEX_MAX_KEYS];
+
+	for (int i = 0; i < keys->nkeys; i++)
+		values[i] = heap_getattr(tuple, keys->keys[i], desc, &nulls[i]);
+
+	return DatumGetHeapTupleHeader(heap_copy_tuple_as_datum(
+		heap_form_tuple(keys->keydesc, values, nulls), keys->keydesc));
+}
+
+/*
+ * Append the change of a row level repack_trigger call to the ring of its
+ * table, and set *bytes to the size of the key and row images it holds.
+ * Returns false if the table is not registered or its ring is full, in which
+ * case the change must be written to the log table.
+ */
+bool
+repack_ring_append(TriggerData *trigdata, Size *bytes)
+{
+	Oid				relid = RelationGetRelid(trigdata->tg_relation);
+	TupleDesc		desc = RelationGetDescr(trigdata->tg_relation);
+	RingTable	   *table;
+	RingKeyEntry   *keys;
+	RingRecord	   *rec;
+	HeapTupleHeader	pk = NULL;
+	HeapTupleHeader	row = NULL;
+	uint32			pklen = 0;
+	uint32			rowlen = 0;
+	uint32			len;
+	uint64			pos;
+	uint64			skip;
+	TransactionId	xid;
+	bool			registered;
+
+	if (ring == NULL)
+		return false;
+
+	LWLockAcquire(ring->lock, LW_SHARED);
+	table = ring_find_table(relid);
+	registered = (table != NULL && !table->spilled);
+	LWLockRelease(ring->lock);
+
+	if (!registered)
+		return false;
+
+	keys = ring_get_keys(trigdata);
+
+	/* INSERT: (NULL, newtup), DELETE: (oldtup, NULL), UPDATE: (oldtup, newtup) */
+	if (!TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		pk = ring_form_pk(trigdata, keys, trigdata->tg_trigtuple);
+	if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+		row = DatumGetHeapTupleHeader(
+			heap_copy_tuple_as_datum(trigdata->tg_trigtuple, desc));
+	else if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+		row = DatumGetHeapTupleHeader(
+			heap_copy_tuple_as_datum(trigdata->tg_newtuple, desc));
+
+	if (pk)
+		pklen = HeapTupleHeaderGetDatumLength(pk);
+	if (row)
+		rowlen = HeapTupleHeaderGetDatumLength(row);
+	len = MAXALIGN(sizeof(RingRecord)) + MAXALIGN(pklen) + MAXALIGN(rowlen);
+	xid = GetCurrentTransactionId();
+
+	LWLockAcquire(table->lock, LW_EXCLUSIVE);
+
+	/* the table may have been unregistered or spilled in the meantime */
+	if (table->relid != relid || table->dboid != MyDatabaseId ||
+		table->logrelid != keys->logrelid || table->spilled)
+	{
+		LWLockRelease(table->lock);
+		return false;
+	}
+
+	/* records don't wrap around: skip the end of the buffer if needed */
+	pos = table->head;
+	skip = ring->size - pos % ring->size;
+	if (skip >= len)
+		skip = 0;
+	if (table->head + skip + len - table->tail > ring->size)
+	{
+		table->spilled = true;
+		LWLockRelease(table->lock);
+		return false;
+	}
+	if (skip > 0)
+	{
+		ring_record(table, pos)->len = 0;
+		pos += skip;
+	}
+
+	rec = ring_record(table, pos);
+	rec->len = len;
+	rec->consumed = false;
+	rec->xid = xid;
+	rec->id = table->next_id++;
+	table->pending++;
+	rec->pklen = pklen;
+	rec->rowlen = rowlen;
+	if (pk)
+		memcpy(RING_RECORD_DATA(rec), pk, pklen);
+	if (row)
+		memcpy(RING_RECORD_DATA(rec) + MAXALIGN(pklen), row, rowlen);
+	table->head = pos + len;
+
+	LWLockRelease(table->lock);
+
+	if (pk)
+		pfree(pk);
+	if (row)
+		pfree(row);
+
+	*bytes = pklen + rowlen;
+	return true;
+}
+
+/* release the ring of relid, if it is registered */
+void
+repack_ring_unregister(Oid relid)
+{
+	RingTable  *table;
+
+	if (ring == NULL)
+		return;
+
+	LWLockAcquire(ring->lock, LW_EXCLUSIVE);
+	table = ring_find_table(relid);
+	if (table)
+	{
+		LWLockAcquire(table->lock, LW_EXCLUSIVE);
+		table->relid = InvalidOid;
+		LWLockRelease(table->lock);
+	}
+	LWLockRelease(ring->lock);
+}
+
+/**
+ * @fn      Datum repack_ring_register(PG_FUNCTION_ARGS)
+ * @brief   Capture the changes of a table in shared memory.
+ *
+ * repack_ring_register(relid)
+ *
+ * Must be called after the log table is created and before repack_trigger
+ * is enabled on the table. A ring left registered for the same table of the
+ * same database by an interrupted run is reset, and so are the rings of other tables whose
+ * owner backend is gone.
+ *
+ * @param	relid	OID of the table being repacked.
+ * @retval			false if pg_repack is not in shared_preload_libraries,
+ *					pg_repack.ring_size is 0 or no ring is free.
+ */
+Datum
+repack_ring_register(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Oid			logrelid;
+	RingTable  *table;
+	char		logname[NAMEDATALEN];
+
+	if (ring == NULL || ring->size == 0)
+		PG_RETURN_BOOL(false);
+
+	snprintf(logname, NAMEDATALEN, "log_%u", relid);
+	logrelid = get_relname_relid(logname, get_namespace_oid("repack", false));
+	if (!OidIsValid(logrelid))
+		elog(ERROR, "pg_repack: table repack.%s not found", logname);
+
+	LWLockAcquire(ring->lock, LW_EXCLUSIVE);
+	table = ring_find_table(relid);
+	if (table == NULL)
+		table = ring_free_table();
+	if (table)
+	{
+		LWLockAcquire(table->lock, LW_EXCLUSIVE);
+		table->dboid = MyDatabaseId;
+		table->relid = relid;
+		table->logrelid = logrelid;
+		table->owner = MyProcPid;
+		table->spilled = false;
+		table->head = table->tail = 0;
+		table->next_id = 1;
+		table->pending = 0;
+		LWLockRelease(table->lock);
+	}
+	LWLockRelease(ring->lock);
+
+	PG_RETURN_BOOL(table != NULL);
+}
+
+/**
+ * @fn      Datum repack_ring_discard(PG_FUNCTION_ARGS)
+ * @brief   Discard the changes already visible to the current snapshot.
+ *
+ * repack_ring_discard(relid)
+ *
+ * The ring counterpart of delete_log: called in the transaction copying the
+ * table, whose snapshot already includes these changes.  Changes of aborted
+ * transactions are discarded too.
+ *
+ * @param	relid	OID of the table being repacked.
+ * @retval			None.
+ */
+Datum
+repack_ring_discard(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Snapshot	snapshot = GetActiveSnapshot();
+	RingTable  *table;
+	bool		keep = false;
+
+	if (ring == NULL)
+		elog(ERROR, "pg_repack must be loaded via shared_preload_libraries");
+
+	table = ring_lock_table(relid);
+
+	for (uint64 pos = table->tail; pos < table->head; pos = ring_next(table, pos))
+	{
+		RingRecord *rec = ring_record(table, pos);
+
+		if (rec->len > 0 && !rec->consumed)
+		{
+			if (committed_in_snapshot(rec->xid, snapshot) ||
+				(!TransactionIdIsInProgress(rec->xid) &&
+				 !TransactionIdDidCommit(rec->xid)))
+			{
+				rec->consumed = true;
+				table->pending--;
+			}
+			else
+				keep = true;
+		}
+		if (!keep)
+			table->tail = ring_next(table, pos);
+	}
+
+	LWLockRelease(table->lock);
+
+	PG_RETURN_VOID();
+}
+
+/**
+ * @fn      Datum repack_ring_peek(PG_FUNCTION_ARGS)
+ * @brief   Return and consume the committed changes of a table.
+ *
+ * repack_ring_peek(relid, count, NULL::repack.log_<relid>)
+ *
+ * Used as sql_peek by repack_apply.  The changes are returned in the order
+ * they were made; those of running transactions are kept for a later call.
+ *
+ * @param	relid	OID of the table being repacked.
+ * @param	count	Max number of changes to return.
+ * @param	logrow	NULL of the row type of the log table, giving the result type.
+ * @retval			Set of rows of the log table (id, key1, ..., keyN, row).
+ */
+Datum
+repack_ring_peek(PG_FUNCTION_ARGS)
+{
+	Oid				relid;
+	int32			count;
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	TupleDesc		keydesc;
+	AttrNumber		keyattnos[INDEX_MAX_KEYS];
+	int				nkeys;
+	Datum			values[INDEX_MAX_KEYS + 2];
+	bool			nulls[INDEX_MAX_KEYS + 2];
+	Tuplestorestate *tupstore;
+	MemoryContext	oldcontext;
+	RingTable	   *table;
+	bool			keep = false;
+	int32			n = 0;
+
+	if (ring == NULL)
+		elog(ERROR, "pg_repack must be loaded via shared_preload_libraries");
+
+	/* not STRICT, the third argument is always NULL */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		elog(ERROR, "repack_ring_peek: relid and count must not be NULL");
+	relid = PG_GETARG_OID(0);
+	count = PG_GETARG_INT32(1);
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	/* the key columns of the log table, between the id and the row */
+	nkeys = tupdesc->natts - 2;
+	if (nkeys < 1 || nkeys > INDEX_MAX_KEYS)
+		elog(ERROR, "repack_ring_peek: unexpected log format");
+	for (int i = 0; i < nkeys; i++)
+		keyattnos[i] = i + 2;
+	keydesc = ring_key_desc(tupdesc, keyattnos, nkeys);
+
+	table = ring_lock_table(relid);
+
+	for (uint64 pos = table->tail;
+		 pos < table->head && (count <= 0 || n < count);
+		 pos = ring_next(table, pos))
+	{
+		RingRecord *rec = ring_record(table, pos);
+
+		if (rec->len > 0 && !rec->consumed)
+		{
+			if (TransactionIdIsInProgress(rec->xid))
+				keep = true;
+			else
+			{
+				if (TransactionIdDidCommit(rec->xid))
+				{
+					values[0] = Int64GetDatum(rec->id);
+					nulls[0] = false;
+					if (rec->pklen > 0)
+					{
+						HeapTupleData	key;
+
+						key.t_len = rec->pklen;
+						ItemPointerSetInvalid(&key.t_self);
+						key.t_tableOid = InvalidOid;
+						key.t_data = (HeapTupleHeader) RING_RECORD_DATA(rec);
+						heap_deform_tuple(&key, keydesc, values + 1, nulls + 1);
+					}
+					else
+					{
+						for (int i = 1; i <= nkeys; i++)
+							nulls[i] = true;
+					}
+					values[nkeys + 1] = PointerGetDatum(RING_RECORD_DATA(rec) +
+														MAXALIGN(rec->pklen));
+					nulls[nkeys + 1] = (rec->rowlen == 0);
+					tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+					n++;
+				}
+				rec->consumed = true;
+				table->pending--;
+			}
+		}
+		if (!keep)
+			table->tail = ring_next(table, pos);
+	}
+
+	LWLockRelease(table->lock);
+
+	return (Datum) 0;
+}
+
+/**
+ * @fn      Datum repack_ring_pending(PG_FUNCTION_ARGS)
+ * @brief   Number of changes of a table left in its ring.
+ *
+ * repack_ring_pending(relid)
+ *
+ * Counts the changes not returned by ring_peek yet, including those of
+ * transactions still in progress.
+ *
+ * @param	relid	OID of the table being repacked.
+ * @retval			The number of changes, 0 if the table is not registered.
+ */
+Datum
+repack_ring_pending(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	RingTable  *table;
+	int64		pending = 0;
+
+	if (ring == NULL)
+		PG_RETURN_INT64(0);
+
+	LWLockAcquire(ring->lock, LW_SHARED);
+	table = ring_find_table(relid);
+	if (table)
+	{
+		LWLockAcquire(table->lock, LW_SHARED);
+		pending = table->pending;
+		LWLockRelease(table->lock);
+	}
+	LWLockRelease(ring->lock);
+
+	PG_RETURN_INT64(pending);
+}
+
+/*
+ * Raise the counter of the log ids to the largest id of the log table whose
+ * id column uses the sequence seqid, repack.log_<relid>_id_seq.  The rows
+ * numbered by the counter since the server started have smaller ids than the
+ * counter already, so only those committed before matter.
+ */
+static void
+log_id_seed(Oid seqid)
+{
+	char	   *seqname = get_rel_name(seqid);
+	Oid			relid;
+	char		sql[64];
+	bool		isnull;
+	uint64		max_id;
+	uint64		cur;
+
+	if (seqname == NULL || sscanf(seqname, "log_%u_id_seq", &relid) != 1)
+		elog(ERROR, "pg_repack: \"%s\" is not the sequence of a log table",
+			 seqname ? seqname : "?");
+
+	snprintf(sql, sizeof(sql), "SELECT max(id) FROM repack.log_%u", relid);
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "pg_repack: SPI_connect failed");
+	if (SPI_execute(sql, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "pg_repack: query failed: %s", sql);
+	max_id = (uint64) DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+												  SPI_tuptable->tupdesc,
+												  1, &isnull));
+	if (isnull)
+		max_id = 0;
+	SPI_finish();
+
+	cur = pg_atomic_read_u64(&ring->log_id);
+	while (cur < max_id &&
+		   !pg_atomic_compare_exchange_u64(&ring->log_id, &cur, max_id))
+		;
+}
+
+/**
+ * @fn      Datum repack_next_log_id(PG_FUNCTION_ARGS)
+ * @brief   Return the id of a new row of a log table.
+ *
+ * repack_next_log_id(seq)
+ *
+ * The default of the id column of the log tables.  The ids only need to
+ * follow the order in which the changes were made, so when pg_repack is
+ * preloaded they are taken from a counter in shared memory, which costs a
+ * single atomic increment where nextval locks the page of the sequence and
+ * writes WAL.  Otherwise nextval is used.
+ *
+ * The counter starts from 0 when the server starts, while a log table may
+ * already hold rows numbered before.  So the first time a backend numbers a
+ * row of a log table, it raises the counter to the largest id of the table.
+ *
+ * @param	seq		Sequence to use when the counter is not available.
+ * @retval			The id.
+ */
+Datum
+repack_next_log_id(PG_FUNCTION_ARGS)
+{
+	Oid			seqid = PG_GETARG_OID(0);
+
+	if (ring == NULL)
+		return DirectFunctionCall1(nextval_oid, PG_GETARG_DATUM(0));
+
+	if (seeded_logs == NULL)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(Oid);
+		seeded_logs = hash_create("pg_repack seeded logs", 16, &ctl,
+								  HASH_ELEM | HASH_BLOBS);
+	}
+
+	if (hash_search(seeded_logs, &seqid, HASH_FIND, NULL) == NULL)
+	{
+		log_id_seed(seqid);
+		hash_search(seeded_logs, &seqid, HASH_ENTER, NULL);
+	}
+
+	PG_RETURN_INT64((int64) pg_atomic_add_fetch_u64(&ring->log_id, 1));
+}
@@ -0,0 +1,16 @@
+/*
+ * pg_repack: lib/repack_ring.h
+ *
+ * Portions Copyright (c) 2012-2020, The Reorg Development Team
+ */
+
+#ifndef REPACK_RING_H
+#define REPACK_RING_H
+
+#include "commands/trigger.h"
+
+extern void repack_ring_init(void);
+extern bool repack_ring_append(TriggerData *trigdata, Size *bytes);
+extern void repack_ring_unregister(Oid relid);
+
+#endif   /* REPACK_RING_H */
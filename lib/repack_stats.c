@@ -0,0 +1,315 @@
+/*
+ * pg_repack: lib/repack_stats.c
+ *
+ * Change capture statistics, reported by repack.capture_stats(): how many
+ * times repack_trigger ran on each table, what it logged and how long it
+ * took, with a histogram of the time per call.
+ *
+ * The counters are updated by repack_trigger in the backends modifying the
+ * tables being repacked, so they live in shared memory and are only
+ * available when pg_repack is listed in shared_preload_libraries.  Each
+ * table, identified by its database and its OID, gets an entry on its first
+ * counted event; the entry is reset when
+ * a new run of pg_repack, identified by the OID of its trigger, starts
+ * counting, and is otherwise kept after the run so that the counters can
+ * be looked at once it is over.
+ *
+ * Portions Copyright (c) 2012-2020, The Reorg Development Team
+ */
+
+#include "postgres.h"
+
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/tuplestore.h"
+
+#include "pgut/pgut-be.h"
+
+#include "repack_stats.h"
+
+/* number of tables whose counters are kept */
+#define STATS_MAX_TABLES	64
+
+/*
+ * Buckets of the latency histogram: the first one counts the calls taking
+ * less than 1us, bucket i those taking from 2^(i-1) to 2^i us, and the last
+ * one those taking 2^(STATS_LATENCY_BUCKETS-2) us (16ms) or more.
+ */
+#define STATS_LATENCY_BUCKETS	16
+
+typedef struct StatsEntry
+{
+	Oid			dboid;		/* database of the table */
+	Oid			relid;		/* counted table, or InvalidOid if free */
+	Oid			tgoid;		/* its repack trigger, identifies the run */
+	pg_atomic_uint64 noop_updates;	/* UPDATEs which changed nothing */
+	pg_atomic_uint64 calls;			/* calls of repack_trigger */
+	pg_atomic_uint64 rows;			/* changes logged */
+	pg_atomic_uint64 bytes;			/* size of the keys and rows logged */
+	pg_atomic_uint64 time_us;		/* time spent in repack_trigger */
+	pg_atomic_uint64 latency[STATS_LATENCY_BUCKETS];
+} StatsEntry;
+
+typedef struct StatsShared
+{
+	slock_t		mutex;		/* protects the assignment of the entries */
+	int			victim;		/* next entry to reuse when all are taken */
+	StatsEntry	entries[STATS_MAX_TABLES];
+} StatsShared;
+
+extern Datum PGUT_EXPORT repack_capture_stats(PG_FUNCTION_ARGS);
+
+PG_FUNCTION_INFO_V1(repack_capture_stats);
+
+static StatsShared *stats = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void
+stats_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(StatsShared)));
+}
+
+static void
+stats_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	stats = ShmemInitStruct("pg_repack stats", sizeof(StatsShared), &found);
+	if (!found)
+	{
+		SpinLockInit(&stats->mutex);
+		stats->victim = 0;
+		for (int i = 0; i < STATS_MAX_TABLES; i++)
+		{
+			StatsEntry *entry = &stats->entries[i];
+
+			entry->dboid = InvalidOid;
+			entry->relid = InvalidOid;
+			entry->tgoid = InvalidOid;
+			pg_atomic_init_u64(&entry->noop_updates, 0);
+			pg_atomic_init_u64(&entry->calls, 0);
+			pg_atomic_init_u64(&entry->rows, 0);
+			pg_atomic_init_u64(&entry->bytes, 0);
+			pg_atomic_init_u64(&entry->time_us, 0);
+			for (int j = 0; j < STATS_LATENCY_BUCKETS; j++)
+				pg_atomic_init_u64(&entry->latency[j], 0);
+		}
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* called by _PG_init when the library is preloaded */
+void
+repack_stats_init(void)
+{
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = stats_shmem_request;
+#else
+	stats_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = stats_shmem_startup;
+}
+
+/* true if entry counts the table relid of the current database */
+static bool
+stats_entry_of(StatsEntry *entry, Oid relid)
+{
+	return entry->relid == relid && entry->dboid == MyDatabaseId;
+}
+
+/*
+ * The entry of the run of pg_repack owning the trigger tgoid, assigning one
+ * if needed.  Returns NULL if the library is not preloaded.
+ */
+static StatsEntry *
+stats_get_entry(Oid relid, Oid tgoid)
+{
+	StatsEntry *entry = NULL;
+
+	if (stats == NULL)
+		return NULL;
+
+	for (int i = 0; i < STATS_MAX_TABLES; i++)
+	{
+		if (stats_entry_of(&stats->entries[i], relid) &&
+			stats->entries[i].tgoid == tgoid)
+			return &stats->entries[i];
+	}
+
+	SpinLockAcquire(&stats->mutex);
+
+	/* look again, then for the entry of a previous run, then a free one */
+	for (int i = 0; i < STATS_MAX_TABLES && entry == NULL; i++)
+	{
+		if (stats_entry_of(&stats->entries[i], relid) &&
+			stats->entries[i].tgoid == tgoid)
+		{
+			SpinLockRelease(&stats->mutex);
+			return &stats->entries[i];
+		}
+	}
+	for (int i = 0; i < STATS_MAX_TABLES && entry == NULL; i++)
+	{
+		if (stats_entry_of(&stats->entries[i], relid))
+			entry = &stats->entries[i];
+	}
+	for (int i = 0; i < STATS_MAX_TABLES && entry == NULL; i++)
+	{
+		if (stats->entries[i].relid == InvalidOid)
+			entry = &stats->entries[i];
+	}
+	if (entry == NULL)
+	{
+		entry = &stats->entries[stats->victim];
+		stats->victim = (stats->victim + 1) % STATS_MAX_TABLES;
+	}
+
+	/* hide the entry from unlocked lookups while it is reset */
+	entry->relid = InvalidOid;
+	pg_write_barrier();
+	pg_atomic_write_u64(&entry->noop_updates, 0);
+	pg_atomic_write_u64(&entry->calls, 0);
+	pg_atomic_write_u64(&entry->rows, 0);
+	pg_atomic_write_u64(&entry->bytes, 0);
+	pg_atomic_write_u64(&entry->time_us, 0);
+	for (int j = 0; j < STATS_LATENCY_BUCKETS; j++)
+		pg_atomic_write_u64(&entry->latency[j], 0);
+	entry->dboid = MyDatabaseId;
+	entry->tgoid = tgoid;
+	pg_write_barrier();
+	entry->relid = relid;
+
+	SpinLockRelease(&stats->mutex);
+
+	return entry;
+}
+
+/* true if the counters are kept, so that the callers can skip timing */
+bool
+repack_stats_enabled(void)
+{
+	return stats != NULL;
+}
+
+/* count an UPDATE of relid which repack_trigger did not log */
+void
+repack_stats_noop_update(Oid relid, Oid tgoid)
+{
+	StatsEntry *entry = stats_get_entry(relid, tgoid);
+
+	if (entry)
+		pg_atomic_fetch_add_u64(&entry->noop_updates, 1);
+}
+
+/* count a call of repack_trigger on relid, which logged rows changes */
+void
+repack_stats_capture(Oid relid, Oid tgoid, uint64 rows, uint64 bytes,
+					 uint64 elapsed_us)
+{
+	StatsEntry *entry = stats_get_entry(relid, tgoid);
+	int			bucket = 0;
+
+	if (entry == NULL)
+		return;
+
+	while (bucket < STATS_LATENCY_BUCKETS - 1 &&
+		   elapsed_us >= (UINT64CONST(1) << bucket))
+		bucket++;
+
+	pg_atomic_fetch_add_u64(&entry->calls, 1);
+	pg_atomic_fetch_add_u64(&entry->rows, rows);
+	pg_atomic_fetch_add_u64(&entry->bytes, bytes);
+	pg_atomic_fetch_add_u64(&entry->time_us, elapsed_us);
+	pg_atomic_fetch_add_u64(&entry->latency[bucket], 1);
+}
+
+/**
+ * @fn      Datum repack_capture_stats(PG_FUNCTION_ARGS)
+ * @brief   Return the change capture counters of the tables.
+ *
+ * repack_capture_stats()
+ *
+ * Only the tables of the current database are returned, their OIDs meaning
+ * nothing in the other ones.
+ *
+ * @retval			Set of (relid, noop_updates, calls, rows_logged,
+ *					bytes_logged, total_time, latency_histogram), empty if
+ *					pg_repack is not in shared_preload_libraries.
+ */
+Datum
+repack_capture_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (int i = 0; stats != NULL && i < STATS_MAX_TABLES; i++)
+	{
+		StatsEntry *entry = &stats->entries[i];
+		Datum		latency[STATS_LATENCY_BUCKETS];
+		Datum		values[7];
+		bool		nulls[7] = { false, false, false, false, false, false, false };
+
+		if (entry->relid == InvalidOid || entry->dboid != MyDatabaseId)
+			continue;
+
+		for (int j = 0; j < STATS_LATENCY_BUCKETS; j++)
+			latency[j] = Int64GetDatum(
+				(int64) pg_atomic_read_u64(&entry->latency[j]));
+
+		values[0] = ObjectIdGetDatum(entry->relid);
+		values[1] = Int64GetDatum(
+			(int64) pg_atomic_read_u64(&entry->noop_updates));
+		values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->calls));
+		values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->rows));
+		values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&entry->bytes));
+		values[5] = Float8GetDatum(
+			(double) pg_atomic_read_u64(&entry->time_us) / 1000.0);
+		values[6] = PointerGetDatum(
+			construct_array(latency, STATS_LATENCY_BUCKETS, INT8OID,
+							sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,16 @@
+/*
+ * pg_repack: lib/repack_stats.h
+ *
+ * Portions Copyright (c) 2012-2020, The Reorg Development Team
+ */
+
+#ifndef REPACK_STATS_H
+#define REPACK_STATS_H
+
+extern void repack_stats_init(void);
+extern bool repack_stats_enabled(void);
+extern void repack_stats_noop_update(Oid relid, Oid tgoid);
+extern void repack_stats_capture(Oid relid, Oid tgoid, uint64 rows,
+								 uint64 bytes, uint64 elapsed_us);
+
+#endif   /* REPACK_STATS_H */
@@ -0,0 +1,67 @@
+--
+-- log applied by the executor directly
+--
+
+CREATE TABLE tbl_direct (id int PRIMARY KEY, v int);
+INSERT INTO tbl_direct VALUES (1, 0);
+
+SELECT relid AS d_oid, pkid AS d_pkid, sql_peek, sql_pop
+  FROM repack.tables WHERE relname = 'public.tbl_direct'
+\gset
+
+SELECT repack.create_log_table(:d_oid, :d_pkid);
+CREATE TABLE repack.table_:d_oid AS SELECT * FROM tbl_direct;
+CREATE UNIQUE INDEX index_:d_pkid ON repack.table_:d_oid (id);
+CREATE TRIGGER repack_trigger AFTER INSERT OR DELETE OR UPDATE ON tbl_direct
+    FOR EACH ROW EXECUTE PROCEDURE repack.repack_trigger('id');
+
+-- a hot key, a key inserted then deleted, a key inserted, updated and changed
+DO $$
+BEGIN
+    FOR i IN 1..100 LOOP
+        UPDATE tbl_direct SET v = v + 1 WHERE id = 1;
+    END LOOP;
+END
+$$;
+INSERT INTO tbl_direct VALUES (2, 0);
+DELETE FROM tbl_direct WHERE id = 2;
+INSERT INTO tbl_direct VALUES (3, 0);
+UPDATE tbl_direct SET v = 5 WHERE id = 3;
+UPDATE tbl_direct SET id = 4 WHERE id = 3;
+
+-- only the last change of each key is applied: a single new row version
+SELECT repack.repack_apply_direct(:d_oid, :d_pkid, :'sql_peek', :'sql_pop', 0);
+SELECT ctid, * FROM repack.table_:d_oid ORDER BY id;
+SELECT count(*) FROM repack.log_:d_oid;
+
+-- the statements registered once for the backend
+SELECT sql_insert_batch, sql_delete_batch
+  FROM repack.tables WHERE relname = 'public.tbl_direct'
+\gset
+SELECT repack.apply_register(:d_oid, :d_pkid, :'sql_peek', :'sql_insert_batch', :'sql_delete_batch', :'sql_pop');
+INSERT INTO tbl_direct VALUES (5, 5);
+SELECT repack.apply_registered(:d_oid, 0);
+UPDATE tbl_direct SET v = 6 WHERE id = 5;
+SELECT repack.apply_registered(:d_oid, 0);
+SELECT * FROM repack.table_:d_oid ORDER BY id;
+
+-- more changes than a batch, read by a cursor over the log
+INSERT INTO tbl_direct SELECT i, i FROM generate_series(10, 2509) i;
+SELECT repack.apply_registered(:d_oid, 1500);
+SELECT repack.apply_registered(:d_oid, 0);
+SELECT count(*), sum(v) FROM repack.table_:d_oid;
+SELECT count(*) FROM repack.log_:d_oid;
+
+-- a row changed back is left in place
+UPDATE tbl_direct SET v = v + 1 WHERE id = 1;
+UPDATE tbl_direct SET v = v - 1 WHERE id = 1;
+SELECT repack.apply_registered(:d_oid, 0);
+SELECT ctid, * FROM repack.table_:d_oid WHERE id = 1;
+
+DROP TABLE repack.log_:d_oid;
+DROP TABLE repack.table_:d_oid;
+DROP TABLE tbl_direct;
+
+-- the new table is filled to 50%, less than its fillfactor, which it keeps
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --apply-fillfactor=50
+SELECT reloptions FROM pg_class WHERE relname = 'tbl_cluster';
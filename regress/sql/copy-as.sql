@@ -0,0 +1,13 @@
+--
+-- copy with CREATE TABLE AS
+--
+
+CREATE TABLE tbl_copy_as (id int PRIMARY KEY, v text);
+INSERT INTO tbl_copy_as SELECT i, md5(i::text) FROM generate_series(1, 1000) i;
+
+-- the scan may use the parallel workers of either setting, whichever allows more
+\! PGOPTIONS='-c max_parallel_workers_per_gather=2 -c max_parallel_maintenance_workers=0' pg_repack --dbname=contrib_regression --table=tbl_copy_as
+\! PGOPTIONS='-c max_parallel_workers_per_gather=0 -c max_parallel_maintenance_workers=2' pg_repack --dbname=contrib_regression --table=tbl_copy_as
+SELECT count(*), sum(id), bool_and(v = md5(id::text)) AS intact FROM tbl_copy_as;
+
+DROP TABLE tbl_copy_as;
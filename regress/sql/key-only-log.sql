@@ -0,0 +1,57 @@
+--
+-- key-only change log
+--
+
+CREATE TABLE tbl_keylog (id int PRIMARY KEY, v text);
+CREATE TABLE tbl_keylog_uniq (id int PRIMARY KEY, u int UNIQUE);
+INSERT INTO tbl_keylog SELECT i, 'v' || i FROM generate_series(1, 10) i;
+
+SELECT relname, create_key_log IS NOT NULL AS key_only
+  FROM repack.tables WHERE relname LIKE 'public.tbl_keylog%' ORDER BY relname;
+
+SELECT relid AS k_oid, pkid AS k_pkid FROM repack.tables WHERE relname = 'public.tbl_keylog'
+\gset
+
+SELECT repack.create_key_log_table(:k_oid, :k_pkid);
+CREATE TABLE repack.table_:k_oid AS SELECT * FROM tbl_keylog;
+CREATE TRIGGER repack_trigger AFTER INSERT OR DELETE OR UPDATE ON tbl_keylog
+    FOR EACH ROW EXECUTE PROCEDURE repack.repack_trigger('id');
+
+INSERT INTO tbl_keylog VALUES (11, 'v11');
+UPDATE tbl_keylog SET v = 'x' WHERE id = 1;
+UPDATE tbl_keylog SET id = 12 WHERE id = 2;
+DELETE FROM tbl_keylog WHERE id = 3;
+UPDATE tbl_keylog SET v = 'y' WHERE id = 1;
+SELECT * FROM repack.log_:k_oid ORDER BY id;
+
+-- each key is applied once, with the current row
+SELECT sql_peek_keys, sql_insert, sql_delete, sql_pop
+  FROM repack.tables WHERE relname = 'public.tbl_keylog'
+\gset
+SELECT repack.repack_apply(:'sql_peek_keys', :'sql_insert', :'sql_delete', NULL, :'sql_pop', 0);
+SELECT count(*) FROM repack.log_:k_oid;
+SELECT * FROM repack.table_:k_oid ORDER BY id;
+
+-- more changes than a batch: each batch groups the next window of the log
+SELECT sql_insert_batch, sql_delete_batch
+  FROM repack.tables WHERE relname = 'public.tbl_keylog'
+\gset
+SELECT repack.apply_register(:k_oid, :k_pkid, :'sql_peek_keys', :'sql_insert_batch', :'sql_delete_batch', :'sql_pop');
+INSERT INTO tbl_keylog SELECT i, 'v' || i FROM generate_series(100, 2599) i;
+UPDATE tbl_keylog SET v = v || 'z' WHERE id = 100;
+SELECT repack.apply_registered(:k_oid, 0);
+SELECT count(*), count(*) FILTER (WHERE v LIKE '%z') FROM repack.table_:k_oid;
+SELECT count(*) FROM repack.log_:k_oid;
+DELETE FROM tbl_keylog WHERE id >= 100;
+
+DROP TRIGGER repack_trigger ON tbl_keylog;
+DROP TABLE repack.table_:k_oid;
+DROP TABLE repack.log_:k_oid;
+
+--
+-- repack with a key-only log
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_keylog --key-only-log
+SELECT * FROM tbl_keylog ORDER BY id;
+\! pg_repack --dbname=contrib_regression --table=tbl_keylog_uniq --key-only-log
+\! pg_repack --dbname=contrib_regression --table=tbl_keylog --key-only-log --capture=ring
@@ -0,0 +1,27 @@
+--
+-- segmented change log
+--
+
+CREATE TABLE tbl_seg (id int PRIMARY KEY);
+
+SELECT relid AS s_oid, pkid AS s_pkid FROM repack.tables WHERE relname = 'public.tbl_seg'
+\gset
+
+SELECT repack.create_log_table(:s_oid, :s_pkid);
+SELECT count(*) FROM pg_catalog.pg_inherits
+ WHERE inhparent = ('repack.log_' || :s_oid)::regclass;
+-- row images are not compressed again
+SELECT attstorage FROM pg_catalog.pg_attribute
+ WHERE attrelid = ('repack.log_' || :s_oid || '_0')::regclass AND attname = 'row';
+SELECT repack.disable_autovacuum(('repack.log_' || :s_oid)::regclass);
+
+INSERT INTO repack.log_:s_oid(pk1) VALUES (1), (2);
+-- segments with changes left to apply are kept
+SELECT repack.truncate_log_segments(:s_oid);
+SELECT count(*) FROM repack.log_:s_oid;
+DELETE FROM repack.log_:s_oid;
+SELECT repack.truncate_log_segments(:s_oid);
+SELECT repack.truncate_log_segments(:s_oid);
+
+DROP TABLE repack.log_:s_oid;
+DROP TABLE tbl_seg;
@@ -0,0 +1,40 @@
+--
+-- change capture by logical decoding
+--
+
+CREATE TABLE tbl_logical (id int PRIMARY KEY, v int);
+INSERT INTO tbl_logical SELECT i, i FROM generate_series(1, 100) i;
+
+SELECT logical_capture FROM repack.tables WHERE relname = 'public.tbl_logical';
+
+--
+-- output plugin
+--
+SELECT relid AS l_oid, pkid AS l_pkid FROM repack.tables WHERE relname = 'public.tbl_logical'
+\gset
+
+CREATE TABLE repack.log_:l_oid (id bigserial PRIMARY KEY, pk1 integer, row public.tbl_logical);
+SELECT 'init' FROM pg_create_logical_replication_slot('repack_test', 'pg_repack');
+
+INSERT INTO tbl_logical VALUES (1000, 1);
+UPDATE tbl_logical SET v = 2 WHERE id = 1000;
+UPDATE tbl_logical SET id = 1001 WHERE id = 1000;
+DELETE FROM tbl_logical WHERE id = 1001;
+SELECT (data::repack.log_:l_oid).pk1, (data::repack.log_:l_oid).row
+  FROM pg_logical_slot_get_changes('repack_test', NULL, NULL, 'relid', :'l_oid', 'pkid', :'l_pkid');
+
+SELECT pg_drop_replication_slot('repack_test');
+DROP TABLE repack.log_:l_oid;
+
+--
+-- repack with logical capture
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_logical --capture=logical
+SELECT count(*), sum(v) FROM tbl_logical;
+SELECT count(*) FROM pg_replication_slots WHERE plugin = 'pg_repack';
+
+-- tables with TOAST need REPLICA IDENTITY FULL
+CREATE TABLE tbl_logical_toast (id int PRIMARY KEY, t text);
+\! pg_repack --dbname=contrib_regression --table=tbl_logical_toast --capture=logical
+ALTER TABLE tbl_logical_toast REPLICA IDENTITY FULL;
+\! pg_repack --dbname=contrib_regression --table=tbl_logical_toast --capture=logical
@@ -3,5 +3,20 @@
 --
 
 \! pg_repack --dbname=contrib_regression --table=tbl_cluster
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --unlogged-log
+-- the log is applied while worker 0 builds the non-key index concurrently;
+-- quiet, as the index definitions name the new table by its OID
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --jobs=2 --apply-during-build --elevel=WARNING
+-- the replay is sized by its measured rate
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --max-swap-apply-ms=100
+-- the estimate of the catch-up is not reported under pg_regress
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --catchup-horizon=3600
 \! pg_repack --dbname=contrib_regression --table=tbl_badindex
 \! pg_repack --dbname=contrib_regression
+
+-- with --jobs, the workers copy the rows by block ranges (PostgreSQL 14+)
+CREATE TABLE tbl_copy_jobs (id int PRIMARY KEY, v text);
+INSERT INTO tbl_copy_jobs SELECT i, md5(i::text) FROM generate_series(1, 1000) i;
+\! pg_repack --dbname=contrib_regression --table=tbl_copy_jobs --jobs=2
+SELECT count(*), sum(id), bool_and(v = md5(id::text)) AS intact FROM tbl_copy_jobs;
+DROP TABLE tbl_copy_jobs;
@@ -0,0 +1,45 @@
+--
+-- shared memory capture of tables of the same OID in two databases
+--
+
+SET client_min_messages = warning;
+DROP DATABASE IF EXISTS contrib_regression_ring1;
+DROP DATABASE IF EXISTS contrib_regression_ring2;
+CREATE DATABASE contrib_regression_ring1 TEMPLATE template0;
+RESET client_min_messages;
+
+\c contrib_regression_ring1
+SET client_min_messages = warning;
+CREATE EXTENSION pg_repack;
+RESET client_min_messages;
+CREATE TABLE ring_t1 (a int PRIMARY KEY);
+SELECT oid AS r_oid FROM pg_catalog.pg_class WHERE relname = 'ring_t1'
+\gset
+CREATE TABLE repack.log_:r_oid (id bigserial PRIMARY KEY, pk1 integer, row public.ring_t1);
+
+-- the clone has the same table, of the same OID
+\c contrib_regression
+CREATE DATABASE contrib_regression_ring2 TEMPLATE contrib_regression_ring1;
+
+-- the changes go to the ring when pg_repack is preloaded with a ring_size,
+-- or to the log table
+\c contrib_regression_ring1
+SELECT repack.ring_register(:r_oid) AS registered
+\gset
+CREATE TRIGGER repack_trigger AFTER INSERT OR DELETE OR UPDATE ON ring_t1
+    FOR EACH ROW EXECUTE PROCEDURE repack.repack_trigger('a');
+INSERT INTO ring_t1 VALUES (1), (2);
+SELECT (SELECT count(*) FROM repack.log_:r_oid) + repack.ring_pending(:r_oid) AS changes;
+
+-- registering the table of the other database doesn't take its ring
+\c contrib_regression_ring2
+SELECT repack.ring_register(:r_oid) AS registered
+\gset
+SELECT repack.ring_pending(:r_oid) AS changes;
+
+\c contrib_regression_ring1
+SELECT (SELECT count(*) FROM repack.log_:r_oid) + repack.ring_pending(:r_oid) AS changes;
+
+\c contrib_regression
+DROP DATABASE contrib_regression_ring1;
+DROP DATABASE contrib_regression_ring2;
@@ -0,0 +1,40 @@
+--
+-- repack.repack_trigger tests, statement level capture
+--
+
+CREATE TABLE trigger_t2 (a int, b int, primary key (a, b));
+
+SELECT create_statement_trigger FROM repack.tables WHERE relname = 'public.trigger_t2';
+
+SELECT oid AS t2_oid FROM pg_catalog.pg_class WHERE relname = 'trigger_t2'
+\gset
+
+CREATE TABLE repack.log_:t2_oid (id bigserial PRIMARY KEY, pk1 integer, pk2 integer, row public.trigger_t2);
+CREATE TRIGGER repack_trigger_insert AFTER INSERT ON trigger_t2
+    REFERENCING NEW TABLE AS repack_new
+    FOR EACH STATEMENT EXECUTE PROCEDURE repack.repack_trigger('a', 'b');
+CREATE TRIGGER repack_trigger_update AFTER UPDATE ON trigger_t2
+    REFERENCING OLD TABLE AS repack_old NEW TABLE AS repack_new
+    FOR EACH STATEMENT EXECUTE PROCEDURE repack.repack_trigger('a', 'b');
+CREATE TRIGGER repack_trigger_delete AFTER DELETE ON trigger_t2
+    REFERENCING OLD TABLE AS repack_old
+    FOR EACH STATEMENT EXECUTE PROCEDURE repack.repack_trigger('a', 'b');
+
+INSERT INTO trigger_t2 VALUES (111, 222), (555, 666);
+UPDATE trigger_t2 SET a=333, b=444 WHERE a = 111;
+DELETE FROM trigger_t2 WHERE a = 333;
+UPDATE trigger_t2 SET a=777 WHERE a = 999;
+SELECT * FROM repack.log_:t2_oid;
+
+--
+-- conflicting triggers are detected
+--
+SELECT repack.conflicted_triggers(:t2_oid);
+
+--
+-- repack with statement level capture
+--
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --capture=statement
+-- pg_repack is not in shared_preload_libraries
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --capture=ring
+\! pg_repack --dbname=contrib_regression --table=tbl_cluster --capture=foo
@@ -10,12 +10,45 @@ SELECT create_trigger FROM repack.tables WHERE relname = 'public.trigger_t1';
 SELECT oid AS t1_oid FROM pg_catalog.pg_class WHERE relname = 'trigger_t1'
 \gset
 
-CREATE TYPE repack.pk_:t1_oid AS (a integer, b integer);
-CREATE TABLE repack.log_:t1_oid (id bigserial PRIMARY KEY, pk repack.pk_:t1_oid, row public.trigger_t1);
+CREATE TABLE repack.log_:t1_oid (id bigserial PRIMARY KEY, pk1 integer, pk2 integer, row public.trigger_t1);
 CREATE TRIGGER repack_trigger AFTER INSERT OR DELETE OR UPDATE ON trigger_t1
     FOR EACH ROW EXECUTE PROCEDURE repack.repack_trigger('a', 'b');
 
 INSERT INTO trigger_t1 VALUES (111, 222);
+-- an UPDATE which changes nothing is not logged
+UPDATE trigger_t1 SET a=111 WHERE a = 111;
 UPDATE trigger_t1 SET a=333, b=444 WHERE a = 111;
 DELETE FROM trigger_t1 WHERE a = 333;
 SELECT * FROM repack.log_:t1_oid;
+
+-- the log is applied a batch at a time, with the result of applying it in order
+CREATE TABLE repack.table_:t1_oid (a int, b int);
+INSERT INTO trigger_t1 VALUES (1, 1), (2, 2);
+UPDATE trigger_t1 SET a = 3 WHERE a = 1;
+UPDATE trigger_t1 SET a = 1 WHERE a = 2;
+DELETE FROM trigger_t1 WHERE a = 3;
+INSERT INTO trigger_t1 VALUES (3, 3);
+SELECT sql_peek, sql_insert_batch, sql_delete_batch, sql_pop
+  FROM repack.tables WHERE relname = 'public.trigger_t1'
+\gset
+SELECT repack.repack_apply_batch(:'sql_peek', :'sql_insert_batch', :'sql_delete_batch', :'sql_pop', 0);
+SELECT * FROM repack.table_:t1_oid ORDER BY a;
+SELECT count(*) FROM repack.log_:t1_oid;
+
+-- or in partitions of the keys, the UPDATEs of a key being logged as two changes
+SELECT log_part_key FROM repack.tables WHERE relname = 'public.trigger_t1'
+\gset
+SELECT :'log_part_key' AS log_part_key;
+-- the log can be indexed on the partitions, as pg_repack does for its workers
+CREATE INDEX ON repack.log_:t1_oid (repack.key_part(2, :log_part_key), id);
+INSERT INTO trigger_t1 VALUES (5, 5);
+UPDATE trigger_t1 SET a = 6 WHERE a = 5;
+UPDATE trigger_t1 SET b = 7 WHERE a = 3;
+DELETE FROM trigger_t1 WHERE a = 1;
+SELECT sum(repack.repack_apply_batch(format('SELECT * FROM repack.log_%s WHERE repack.key_part(2, %s) = %s ORDER BY id LIMIT $1', :t1_oid, :'log_part_key', p)::cstring, :'sql_insert_batch', :'sql_delete_batch', :'sql_pop', 0))
+  FROM generate_series(0, 1) p;
+SELECT * FROM repack.table_:t1_oid ORDER BY a;
+SELECT count(*) FROM repack.log_:t1_oid;
+
+-- the trigger is only counted when pg_repack is preloaded
+SELECT count(*) FROM repack.capture_stats();